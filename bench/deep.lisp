@@ -0,0 +1,3 @@
+(define sum (lambda (n) (if (< n 1) 0 (+ n (sum (- n 1))))))
+(define loop (lambda (k n) (if (< k 1) n (loop (- k 1) (sum 10000)))))
+(loop 20 0)
@@ -0,0 +1,5 @@
+(define iota (lambda (n l) (if (< n 1) l (iota (- n 1) (cons n l)))))
+(define rev (lambda (l r) (if l (rev (cdr l) (cons (car l) r)) r)))
+(define len (lambda (l n) (if l (len (cdr l) (+ n 1)) n)))
+(define loop (lambda (k n) (if (< k 1) n (loop (- k 1) (len (rev (iota 100000 ()) ()) 0)))))
+(loop 3 0)
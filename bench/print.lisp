@@ -0,0 +1,4 @@
+(define iota (lambda (n l) (if (< n 1) l (iota (- n 1) (cons (/ n 7) l)))))
+(define tree (lambda (d) (if (< d 1) (quote leaf) (cons (tree (- d 1)) (tree (- d 1))))))
+(iota 200000 ())
+(tree 16)
@@ -0,0 +1,64 @@
+#!/bin/sh
+# Run the benchmarks of this directory with a tinylisp binary, and print the
+# time, the maximum number of live cells and the number of pairs allocated by
+# each one.
+#
+# Usage: bench/run.sh [BINARY] [BASELINE]
+#
+# If a BASELINE binary is given, it runs the same benchmarks and the ratio of
+# the times is printed too. The arguments of the binaries can be changed with
+# BENCH_FLAGS, e.g. BENCH_FLAGS="-g -c".
+
+bin=${1:-./tinylisp.out}
+base=$2
+flags=${BENCH_FLAGS:--g -n 262144}
+dir=$(dirname "$0")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Parsing of many different symbols, generated instead of stored
+awk 'BEGIN {
+    for (i = 0; i < 4000; i++) {
+        printf "(quote (";
+        for (j = 0; j < 50; j++)
+            printf " s%d_%d", i % 400, j;
+        print "))";
+    }
+}' > "$tmp/symbols.lisp"
+
+# run BINARY FILE: print the time in milliseconds, the maximum number of live
+# cells and the number of pairs allocated
+run() {
+    start=$(date +%s%N)
+    TINYLISP_STATS=1 $1 $flags "$2" > /dev/null 2> "$tmp/stats" || {
+        echo "$2 failed:" >&2
+        cat "$tmp/stats" >&2
+        exit 1
+    }
+    end=$(date +%s%N)
+
+    awk -v ms=$(((end - start) / 1000000)) '
+        /^live cells/ { live = substr($6, 1, length($6) - 1) }
+        /^conses/     { conses = $2 }
+        END           { print ms, live, conses }' "$tmp/stats"
+}
+
+if [ -n "$base" ]; then
+    printf "%-10s %10s %12s %12s %10s %6s\n" benchmark ms "max live" conses \
+        "base ms" ratio
+else
+    printf "%-10s %10s %12s %12s\n" benchmark ms "max live" conses
+fi
+
+for file in "$dir"/*.lisp "$tmp/symbols.lisp"; do
+    name=$(basename "$file" .lisp)
+    set -- $(run "$bin" "$file")
+
+    if [ -n "$base" ]; then
+        b=$(run "$base" "$file" | cut -d " " -f 1)
+        printf "%-10s %10d %12d %12d %10d %6.2f\n" "$name" "$1" "$2" "$3" \
+            "$b" "$(awk -v a="$1" -v b="$b" 'BEGIN { print b ? a / b : 0 }')"
+    else
+        printf "%-10s %10d %12d %12d\n" "$name" "$1" "$2" "$3"
+    fi
+done
@@ -0,0 +1,998 @@
+/**
+ * @file      bytecode.h
+ * @brief     Bytecode compiler and virtual machine
+ * @author    8dcc
+ *
+ * When compiling is enabled (see compiling), the bodies of the closures are
+ * compiled to CODE blocks, which are run by exec() instead of being evaluated
+ * by eval(). The bytecode uses the same frames, globals and primitives as the
+ * interpreter, so both can call each other.
+ */
+
+#ifndef BYTECODE_H_
+#define BYTECODE_H_ 1
+
+/*
+ * Instructions
+ * Each instruction is an opcode followed by its operands. Opcodes, counts and
+ * jump offsets are stored as raw integers (NaN-boxed with tag 0), so the garbage
+ * collector ignores them, and the rest of the operands are Lisp expressions.
+ *
+ * Jump offsets are relative to the instruction following the jump, and only
+ * jump forwards.
+ *
+ *  Instruction       | Description
+ * -------------------|----------------------------------------------------------
+ *  CONST x           | push x
+ *  LOCAL a           | push the local variable with lexical address a
+ *  GLOBAL v          | push the global value of the atom v
+ *  EVAL x            | push x evaluated by eval(), for forms we don't compile
+ *  JUMP k            | skip k words
+ *  JNIL k            | pop a value, and skip k words if it's nil
+ *  OR k              | skip k words if the top is not nil, otherwise pop it
+ *  AND k             | skip k words if the top is nil, otherwise pop it
+ *  FORM v p k        | skip k words if the global value of the atom v is no
+ *                    | longer the primitive p, see compile_guarded()
+ *  PRIM t k          | if the top is a primitive, replace it with its value for
+ *                    | the unevaluated arguments t and skip k words
+ *  CALL n            | call the function bellow the n arguments on the top
+ *  TAIL n            | same as CALL, but replacing the current call
+ *  RET               | return the top to the caller
+ *  CLOSURE v c       | push a closure of the variables v and body c
+ *  BIND v            | pop a value, and bind it to v in a new frame
+ *  UNBIND n          | drop the last n frames created by BIND
+ *  DEFINE v          | pop a value, define v globally, and push v
+ *  ADD v f n, ...    | inlined primitive f of n arguments, called with the
+ *                    | global value of v instead if it's no longer f
+ */
+enum {
+    OP_CONST,
+    OP_LOCAL,
+    OP_GLOBAL,
+    OP_EVAL,
+    OP_JUMP,
+    OP_JNIL,
+    OP_OR,
+    OP_AND,
+    OP_FORM,
+    OP_PRIM,
+    OP_CALL,
+    OP_TAIL,
+    OP_RET,
+    OP_CLOSURE,
+    OP_BIND,
+    OP_UNBIND,
+    OP_DEFINE,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_LT,
+    OP_EQU,
+    OP_NOT,
+    OP_CONS,
+    OP_CAR,
+    OP_CDR,
+};
+
+/**
+ * @var inlined
+ * @brief Primitives compiled to their own instruction, and their arity
+ * @details An arity of zero means any number of arguments, but at least one.
+ */
+static const struct {
+    L (*f)(L, L*);
+    I op, n;
+} inlined[] = {
+    { f_add, OP_ADD, 0 }, { f_sub, OP_SUB, 0 }, { f_mul, OP_MUL, 0 },
+    { f_div, OP_DIV, 0 }, { f_lt, OP_LT, 2 },   { f_eq, OP_EQU, 2 },
+    { f_not, OP_NOT, 1 }, { f_cons, OP_CONS, 2 }, { f_car, OP_CAR, 1 },
+    { f_cdr, OP_CDR, 1 }, { NULL, 0, 0 },
+};
+
+/*--------------------------------- COMPILER ---------------------------------*/
+
+/**
+ * @brief Append `x` to the instructions being compiled, see ops
+ * @param[in] x Opcode or operand
+ * @return Index of `x` in ops[]
+ */
+static I emit(L x) {
+    if (ops_len == ops_size) {
+        ops_size = ops_size ? ops_size * 2 : 256;
+        ops      = realloc(ops, ops_size * sizeof(L));
+        if (ops == NULL) {
+            fprintf(stderr, "Couldn't allocate the bytecode buffer.\n");
+            abort();
+        }
+    }
+
+    ops[ops_len] = x;
+    return ops_len++;
+}
+
+/**
+ * @brief Append opcode `op` or a raw integer operand
+ * @param[in] op Raw integer
+ * @return Index of the integer in ops[]
+ */
+static I emit_raw(I op) {
+    return emit(box(0, op));
+}
+
+/**
+ * @brief Make the jump whose offset is at index `at` skip to the end of ops[]
+ * @param[in] at Index returned by emit_raw() for the offset
+ */
+static void patch(I at) {
+    ops[at] = box(0, ops_len - at - 1);
+}
+
+/**
+ * @brief Number of elements of the list `t`
+ * @param[in] t List
+ * @return Number of elements, or NOT_FOUND if `t` is not a proper list
+ */
+static I length(L t) {
+    I n = 0;
+
+    for (; T(t) == CONS; t = cdr(t))
+        n++;
+
+    return T(t) == NIL ? n : NOT_FOUND;
+}
+
+/**
+ * @brief Check if the atom `v` is a variable in the scope `s` or in the
+ * environment `e`
+ * @param[in] v Atom
+ * @param[in] s Scope, see address()
+ * @param[in] e Runtime environment, see address()
+ * @return Non-zero if `v` is a local variable
+ */
+static I bound(L v, L s, L e) {
+    for (; T(s) == CONS; s = cdr(s))
+        if (slot(v, car(s)) != NOT_FOUND)
+            return 1;
+
+    for (; T(e) == FRAME; e = ELEM(e, FRAME_PARENT))
+        if (slot(v, ELEM(e, FRAME_NAMES)) != NOT_FOUND)
+            return 1;
+
+    return 0;
+}
+
+/**
+ * @brief Compile the clauses `t` of a `cond` form, see f_cond()
+ * @details Each clause is compiled as an `if` whose else branch is the rest of
+ * the clauses.
+ * @param[in] t List of clauses
+ * @param[in] s Scope, see address()
+ * @param[in] e Runtime environment, see address()
+ * @param[in] tail Non-zero if the form is in tail position
+ */
+static void compile_cond(L t, L s, L e, I tail) {
+    L y;
+    I at, end = 0;
+
+    if (T(t) != CONS) {
+        emit_raw(OP_CONST);
+        emit(err);
+        if (tail)
+            emit_raw(OP_RET);
+        return;
+    }
+
+    PROTECT(t);
+    PROTECT(s);
+    PROTECT(e);
+    compile_expr(car(car(t)), s, e, 0);
+    emit_raw(OP_JNIL);
+    at = emit_raw(0);
+
+    y = cdr(car(t));
+    if (T(y) == CONS) {
+        compile_expr(car(y), s, e, tail);
+    } else {
+        emit_raw(OP_CONST);
+        emit(err);
+        if (tail)
+            emit_raw(OP_RET);
+    }
+
+    if (!tail) {
+        emit_raw(OP_JUMP);
+        end = emit_raw(0);
+    }
+
+    patch(at);
+    compile_cond(cdr(t), s, e, tail);
+
+    if (!tail)
+        patch(end);
+
+    UNPROTECT(3);
+}
+
+/**
+ * @brief Compile the expressions `t` of an `or` or `and` form
+ * @param[in] t List of expressions
+ * @param[in] s Scope, see address()
+ * @param[in] e Runtime environment, see address()
+ * @param[in] op OP_OR or OP_AND
+ */
+static void compile_logic(L t, L s, L e, I op) {
+    L y;
+    I at;
+
+    if (T(t) != CONS) {
+        emit_raw(OP_CONST);
+        emit(nil);
+        return;
+    }
+
+    PROTECT(t);
+    PROTECT(s);
+    PROTECT(e);
+    compile_expr(car(t), s, e, 0);
+
+    y = cdr(t);
+    if (T(y) == CONS) {
+        emit_raw(op);
+        at = emit_raw(0);
+        compile_logic(y, s, e, op);
+        patch(at);
+    }
+
+    UNPROTECT(3);
+}
+
+/**
+ * @brief Compile a call to the function `car(x)`
+ * @details The function is evaluated first. If it's a primitive, it's called
+ * with the unevaluated (but resolved) arguments, like in eval(). Otherwise, the
+ * arguments are evaluated on the stack and the function is called with them.
+ * @param[in] x Form to compile
+ * @param[in] s Scope, see address()
+ * @param[in] e Runtime environment, see address()
+ * @param[in] tail Non-zero if the form is in tail position
+ */
+static void compile_call(L x, L s, L e, I tail) {
+    L t;
+    I at, n = 0;
+
+    PROTECT(x);
+    PROTECT(s);
+    PROTECT(e);
+    compile_expr(car(x), s, e, 0);
+    t = resolve_list(cdr(x), s, e);
+    emit_raw(OP_PRIM);
+    emit(t);
+    at = emit_raw(0);
+
+    for (t = cdr(x); T(t) == CONS; t = cdr(t), n++) {
+        PROTECT(t);
+        compile_expr(car(t), s, e, 0);
+        UNPROTECT(1);
+    }
+
+    emit_raw(tail ? OP_TAIL : OP_CALL);
+    emit_raw(n);
+    patch(at);
+
+    if (tail)
+        emit_raw(OP_RET);
+
+    UNPROTECT(3);
+}
+
+/**
+ * @brief Compile the special form or inlined primitive `x`, whose function is
+ * the primitive `p`
+ * @param[in] x Form to compile
+ * @param[in] p Primitive in the global value of `car(x)`
+ * @param[in] s Scope, see address()
+ * @param[in] e Runtime environment, see address()
+ * @param[in] tail Non-zero if the form is in tail position
+ * @return Non-zero if the form was compiled, zero if it's a normal call
+ */
+static I compile_form(L x, L p, L s, L e, I tail) {
+    L (*f)(L, L*) = prim[ord(p)].f;
+    L y;
+    I at, end = 0, n = length(cdr(x));
+
+    if (n == NOT_FOUND)
+        return 0;
+
+    if (f == f_quote && n == 1) {
+        emit_raw(OP_CONST);
+        emit(car(cdr(x)));
+    } else if (f == f_if && (n == 2 || n == 3)) {
+        /* (if x y z), a missing z is ERR like in f_if() */
+        PROTECT(x);
+        PROTECT(s);
+        PROTECT(e);
+        compile_expr(car(cdr(x)), s, e, 0);
+        emit_raw(OP_JNIL);
+        at = emit_raw(0);
+        compile_expr(car(cdr(cdr(x))), s, e, tail);
+
+        if (!tail) {
+            emit_raw(OP_JUMP);
+            end = emit_raw(0);
+        }
+
+        patch(at);
+        if (n == 3) {
+            compile_expr(car(cdr(cdr(cdr(x)))), s, e, tail);
+        } else {
+            emit_raw(OP_CONST);
+            emit(err);
+            if (tail)
+                emit_raw(OP_RET);
+        }
+
+        if (!tail)
+            patch(end);
+
+        UNPROTECT(3);
+        return 1;
+    } else if (f == f_cond) {
+        compile_cond(cdr(x), s, e, tail);
+        return 1;
+    } else if (f == f_or || f == f_and) {
+        compile_logic(cdr(x), s, e, f == f_or ? OP_OR : OP_AND);
+    } else if (f == f_leta && n > 0) {
+        /* (let* (v1 x1) (v2 x2) ... y), each binding is a new frame */
+        PROTECT(s);
+        PROTECT(e);
+        PROTECT(x);
+        for (x = cdr(x), n = 0; let(x); x = cdr(x), n++) {
+            compile_expr(car(cdr(car(x))), s, e, 0);
+            emit_raw(OP_BIND);
+            emit(car(car(x)));
+            s = cons(car(car(x)), s);
+        }
+
+        compile_expr(car(x), s, e, tail);
+        UNPROTECT(3);
+
+        if (tail)
+            return 1;
+
+        if (n > 0) {
+            emit_raw(OP_UNBIND);
+            emit_raw(n);
+        }
+    } else if (f == f_lambda && n >= 2) {
+        /* (lambda v y), the body is compiled now with v in the scope */
+        PROTECT(x);
+        y = compile(car(cdr(x)), car(cdr(cdr(x))), s, e);
+        UNPROTECT(1);
+        emit_raw(OP_CLOSURE);
+        emit(car(cdr(x)));
+        emit(y);
+    } else if (f == f_define && n == 2) {
+        y = car(cdr(x));
+        if (T(y) != ATOM)
+            return 0;
+
+        PROTECT(x);
+        compile_expr(car(cdr(cdr(x))), s, e, 0);
+        UNPROTECT(1);
+        emit_raw(OP_DEFINE);
+        emit(car(cdr(x)));
+    } else {
+        I i;
+        for (i = 0; inlined[i].f != NULL; i++)
+            if (inlined[i].f == f && (inlined[i].n ? n == inlined[i].n : n > 0))
+                break;
+
+        if (inlined[i].f == NULL)
+            return 0;
+
+        /* The arguments are evaluated in order on the stack */
+        PROTECT(x);
+        PROTECT(s);
+        PROTECT(e);
+        for (y = cdr(x); T(y) == CONS; y = cdr(y)) {
+            PROTECT(y);
+            compile_expr(car(y), s, e, 0);
+            UNPROTECT(1);
+        }
+        UNPROTECT(3);
+
+        emit_raw(inlined[i].op);
+        emit(car(x));
+        emit(p);
+        emit_raw(n);
+    }
+
+    if (tail)
+        emit_raw(OP_RET);
+
+    return 1;
+}
+
+/**
+ * @brief Compile the form `x` with compile_form(), falling back to evaluating
+ * it if the global value of `car(x)` is no longer the primitive `p`
+ * @details Special forms are compiled for the binding they have now, so they
+ * are guarded by a FORM instruction that skips to `x` resolved and evaluated by
+ * eval(), which then calls the new value. Inlined primitives already check it,
+ * see INLINED.
+ * @param[in] x Form to compile
+ * @param[in] p Primitive in the global value of `car(x)`
+ * @param[in] s Scope, see address()
+ * @param[in] e Runtime environment, see address()
+ * @param[in] tail Non-zero if the form is in tail position
+ * @return Non-zero if the form was compiled, zero if it's a normal call
+ */
+static I compile_guarded(L x, L p, L s, L e, I tail) {
+    L (*f)(L, L*) = prim[ord(p)].f;
+    const I start = ops_len;
+    I at, end = 0;
+
+    for (I i = 0; inlined[i].f != NULL; i++)
+        if (inlined[i].f == f)
+            return compile_form(x, p, s, e, tail);
+
+    emit_raw(OP_FORM);
+    emit(box(ATOM, ord(car(x))));
+    emit(p);
+    at = emit_raw(0);
+
+    PROTECT(x);
+    PROTECT(s);
+    PROTECT(e);
+    if (!compile_form(x, p, s, e, tail)) {
+        UNPROTECT(3);
+        ops_len = start;
+        return 0;
+    }
+
+    if (!tail) {
+        emit_raw(OP_JUMP);
+        end = emit_raw(0);
+    }
+
+    patch(at);
+    x = resolve(x, s, e);
+    UNPROTECT(3);
+    emit_raw(OP_EVAL);
+    emit(x);
+
+    if (tail)
+        emit_raw(OP_RET);
+    else
+        patch(end);
+
+    return 1;
+}
+
+/**
+ * @brief Compile the expression `x` to the end of ops[]
+ * @details Local variables are compiled to their lexical address, and globals
+ * to their atom. Special forms and inlined primitives are only recognized if
+ * their name is not local, like in resolve(). Anything else is a call.
+ *
+ * If `tail` is non-zero, the instructions end returning the value of `x`, and
+ * calls are compiled as tail calls.
+ * @param[in] x Expression to compile
+ * @param[in] s Scope, see address()
+ * @param[in] e Runtime environment, see address()
+ * @param[in] tail Non-zero if the expression is in tail position
+ */
+static void compile_expr(L x, L s, L e, I tail) {
+    L y, p;
+
+    /* Expressions resolved by resolve(), inside a call with a variable list of
+     * arguments, are resolved again in the scope being compiled */
+    if (T(x) == LREF || T(x) == GREF)
+        x = box(ATOM, ord(x));
+
+    if (T(x) == ATOM) {
+        y = address(x, s, e);
+        if (T(y) == LREF) {
+            emit_raw(OP_LOCAL);
+            emit(y);
+        } else if (bound(x, s, e)) {
+            /* Too deep for a lexical address, search it by name */
+            emit_raw(OP_EVAL);
+            emit(x);
+        } else {
+            emit_raw(OP_GLOBAL);
+            emit(x);
+        }
+    } else if (T(x) != CONS) {
+        emit_raw(OP_CONST);
+        emit(x);
+    } else {
+        y = car(x);
+        if (T(y) == GREF) {
+            /* Drop the value of a folded form, see resolve() */
+            if (gref_form(y) == FORM_CONST) {
+                PROTECT(s);
+                PROTECT(e);
+                x = cons(y, cdr(cdr(x)));
+                UNPROTECT(2);
+            }
+
+            y = box(ATOM, ord(y));
+        }
+
+        if (T(y) == ATOM && !bound(y, s, e) && (p = GLOBAL(y), T(p) == PRIM) &&
+            compile_guarded(x, p, s, e, tail))
+            return;
+
+        if (length(cdr(x)) != NOT_FOUND) {
+            compile_call(x, s, e, tail);
+            return;
+        }
+
+        /* Calls with a variable list of arguments, (f . args) */
+        PROTECT(x);
+        y = resolve(x, s, e);
+        UNPROTECT(1);
+        emit_raw(OP_EVAL);
+        emit(y);
+    }
+
+    if (tail)
+        emit_raw(OP_RET);
+}
+
+/**
+ * @brief Compile the body `x` of a closure with the variables `v`
+ * @details The instructions are emitted to ops[], which is a garbage collector
+ * root, and copied to a new CODE block at the end. Nested closures are
+ * compiled in the same buffer, after the instructions of the enclosing one.
+ * @param[in] v List of variables, see slots()
+ * @param[in] x Body of the closure
+ * @param[in] s Scope of the enclosing closures, see address()
+ * @param[in] e Runtime environment where the closure is created
+ * @return NaN-boxed CODE block
+ */
+static L compile(L v, L x, L s, L e) {
+    const I start = ops_len;
+    L code;
+
+    PROTECT(x);
+    PROTECT(e);
+    s = cons(v, s);
+    compile_expr(x, s, e, 1);
+    UNPROTECT(2);
+
+    code = block(CODE, ops_len - start, nil);
+    for (I j = start; j < ops_len; j++)
+        SET_ELEM(code, j - start, ops[j]);
+
+    ops_len = start;
+    return code;
+}
+
+/*----------------------------- VIRTUAL MACHINE ------------------------------*/
+
+/**
+ * @brief Push `x` to the stack of the virtual machine, see vm
+ * @param[in] x Value to push
+ */
+static inline void vm_push(L x) {
+    if (vp == vm_size) {
+        vm_size = vm_size ? vm_size * 2 : 1024;
+        vm      = realloc(vm, vm_size * sizeof(L));
+        if (vm == NULL) {
+            fprintf(stderr, "Couldn't grow the bytecode stack.\n");
+            abort();
+        }
+    }
+
+    vm[vp++] = x;
+}
+
+/**
+ * @brief Quote each of the `n` values on the top of the stack
+ * @details Used to call primitives, which receive unevaluated arguments, with
+ * values that were already evaluated.
+ * @param[in] n Number of values
+ * @return List of `(quote x)` forms
+ */
+static L quoted(I n) {
+    L t = nil, x;
+    PROTECT(t);
+
+    for (I j = vp; j > vp - n; j--) {
+        x = cons(vm[j - 1], nil);
+        x = cons(atom("quote"), x);
+        t = cons(x, t);
+    }
+
+    UNPROTECT(1);
+    return t;
+}
+
+/**
+ * @def OPERAND
+ * @brief Read the next word of the code being executed, see exec()
+ */
+#define OPERAND() unpack(*(ins - pc++))
+
+/**
+ * @def RELOAD
+ * @brief Recompute the address of the code being executed, after anything that
+ * might have moved it, e.g. an allocation
+ */
+#define RELOAD() (ins = &cell[N - ord(code) - 1])
+
+/*
+ * Dispatch
+ * With GCC (or compatible compilers), each instruction jumps directly to the
+ * next one through a table of label addresses, instead of going back to a
+ * switch. Defining NO_THREADING uses the portable switch.
+ */
+#if defined(__GNUC__) && !defined(NO_THREADING)
+#define THREADED    1
+#define DISPATCH()  goto* labels[ord(OPERAND())]
+#define CASE(op)    op_##op
+#else
+#define DISPATCH()  goto dispatch
+#define CASE(op)    case OP_##op
+#endif
+
+/**
+ * @brief Run the CODE block `code` in environment `*env`
+ * @details Stack machine, using the stack of the virtual machine (see vm) for
+ * the arguments and intermediate values. Calls to compiled closures don't
+ * recurse: the caller's code, position and environment are pushed to the stack
+ * and restored by RET, so only calls to the interpreter use the C stack.
+ *
+ * Like the primitives in PrimPair, tail calls to the interpreter (e.g. `eval`)
+ * are not evaluated here when there is nothing left to return to. The
+ * expression is returned instead, `*env` is set to its environment, and
+ * `*more` to non-zero, so eval() can evaluate it in its loop.
+ * @param[in] code NaN-boxed CODE block, see compile()
+ * @param[in,out] env Environment of the code
+ * @param[out] more Set to non-zero if the returned expression must be evaluated
+ * @return Returned value, or expression to evaluate
+ */
+static L exec(L code, L* env, I* more) {
+    const I base = vp;
+    I pc = 0, n, tail;
+    L e = *env, f, x, d, v;
+    C* ins;
+
+#ifdef THREADED
+    static void* const labels[] = {
+        [OP_CONST] = &&op_CONST,     [OP_LOCAL] = &&op_LOCAL,
+        [OP_GLOBAL] = &&op_GLOBAL,   [OP_EVAL] = &&op_EVAL,
+        [OP_JUMP] = &&op_JUMP,       [OP_JNIL] = &&op_JNIL,
+        [OP_OR] = &&op_OR,           [OP_AND] = &&op_AND,
+        [OP_FORM] = &&op_FORM,       [OP_PRIM] = &&op_PRIM,
+        [OP_CALL] = &&op_CALL,       [OP_TAIL] = &&op_TAIL,
+        [OP_RET] = &&op_RET,
+        [OP_CLOSURE] = &&op_CLOSURE,
+        [OP_BIND] = &&op_BIND,       [OP_UNBIND] = &&op_UNBIND,
+        [OP_DEFINE] = &&op_DEFINE,   [OP_ADD] = &&op_ADD,
+        [OP_SUB] = &&op_SUB,         [OP_MUL] = &&op_MUL,
+        [OP_DIV] = &&op_DIV,         [OP_LT] = &&op_LT,
+        [OP_EQU] = &&op_EQU,         [OP_NOT] = &&op_NOT,
+        [OP_CONS] = &&op_CONS,       [OP_CAR] = &&op_CAR,
+        [OP_CDR] = &&op_CDR,
+    };
+#endif
+
+    PROTECT(code);
+    PROTECT(e);
+    RELOAD();
+
+#ifdef THREADED
+    DISPATCH();
+#else
+dispatch:
+    switch (ord(OPERAND())) {
+#endif
+
+    CASE(CONST):
+        vm_push(OPERAND());
+        DISPATCH();
+
+    CASE(LOCAL):
+        x = OPERAND();
+        vm_push(local(x, e));
+        DISPATCH();
+
+    CASE(GLOBAL):
+        x = OPERAND();
+        vm_push(equ(GLOBAL(x), err) ? assoc(x, nil) : GLOBAL(x));
+        DISPATCH();
+
+    CASE(EVAL):
+        x = OPERAND();
+        x = eval(x, e);
+        vm_push(x);
+        RELOAD();
+        DISPATCH();
+
+    CASE(JUMP):
+        n = ord(OPERAND());
+        pc += n;
+        DISPATCH();
+
+    CASE(JNIL):
+        n = ord(OPERAND());
+        if (not(vm[--vp]))
+            pc += n;
+        DISPATCH();
+
+    CASE(OR):
+        n = ord(OPERAND());
+        if (!not(vm[vp - 1]))
+            pc += n;
+        else
+            vp--;
+        DISPATCH();
+
+    CASE(AND):
+        n = ord(OPERAND());
+        if (not(vm[vp - 1]))
+            pc += n;
+        else
+            vp--;
+        DISPATCH();
+
+    CASE(FORM):
+        v = OPERAND();
+        f = OPERAND();
+        n = ord(OPERAND());
+        if (!equ(GLOBAL(v), f))
+            pc += n;
+        DISPATCH();
+
+    CASE(PRIM):
+        x = OPERAND();
+        n = ord(OPERAND());
+        f = vm[vp - 1];
+        if (T(f) == PRIM) {
+            /* Primitives like let* can modify the environment, but only for
+             * the expression they return */
+            vp--;
+            d = e;
+            PROTECT(d);
+            x = prim[ord(f)].f(x, &d);
+            UNPROTECT(1);
+
+            /* Tail call, let eval() continue if the next instruction returns
+             * from exec() */
+            if (prim[ord(f)].t) {
+                RELOAD();
+                if (vp == base && ord(unpack(*(ins - pc - n))) == OP_RET) {
+                    UNPROTECT(2);
+                    *env  = d;
+                    *more = 1;
+                    return x;
+                }
+
+                x = eval(x, d);
+            }
+
+            vm_push(x);
+            RELOAD();
+            pc += n;
+        }
+        DISPATCH();
+
+    CASE(CALL):
+        n    = ord(OPERAND());
+        tail = 0;
+        goto call;
+
+    CASE(TAIL):
+        n    = ord(OPERAND());
+        tail = 1;
+        goto call;
+
+    CASE(RET):
+    ret:
+        x = vm[--vp];
+        if (vp == base) {
+            UNPROTECT(2);
+            *more = 0;
+            return x;
+        }
+
+        e    = vm[--vp];
+        pc   = ord(vm[--vp]);
+        code = vm[--vp];
+        vm[vp++] = x;
+        RELOAD();
+        DISPATCH();
+
+    CASE(CLOSURE):
+        v = OPERAND();
+        x = OPERAND();
+        x = closure(v, x, e);
+        vm_push(x);
+        RELOAD();
+        DISPATCH();
+
+    CASE(BIND):
+        v = OPERAND();
+        x = vm[--vp];
+        e = bind(v, x, e);
+        RELOAD();
+        DISPATCH();
+
+    CASE(UNBIND):
+        for (n = ord(OPERAND()); n > 0; n--)
+            e = ELEM(e, FRAME_PARENT);
+        DISPATCH();
+
+    CASE(DEFINE):
+        v = OPERAND();
+        define(v, vm[vp - 1]);
+        vm[vp - 1] = v;
+        DISPATCH();
+
+/* The global value of the atom v is still the primitive f, or it's called
+ * with the n arguments as any other function */
+#define INLINED(expr)                               \
+    v = OPERAND();                                  \
+    f = OPERAND();                                  \
+    n = ord(OPERAND());                             \
+    if (!equ(GLOBAL(v), f))                         \
+        goto redefined;                             \
+    expr;                                           \
+    DISPATCH();
+
+/* Apply `op` from left to right to the n numbers on the top */
+#define FOLD(op)                                    \
+    INLINED(x = vm[vp - n];                         \
+            for (I j = vp - n + 1; j < vp; j++) x op vm[j]; \
+            vp -= n;                                \
+            vm[vp++] = num(x))
+
+    CASE(ADD):
+        FOLD(+=);
+
+    CASE(SUB):
+        FOLD(-=);
+
+    CASE(MUL):
+        FOLD(*=);
+
+    CASE(DIV):
+        FOLD(/=);
+
+    CASE(LT):
+        INLINED(vp--; vm[vp - 1] = vm[vp - 1] < vm[vp] ? tru : nil);
+
+    CASE(EQU):
+        INLINED(vp--; vm[vp - 1] = equ(vm[vp - 1], vm[vp]) ? tru : nil);
+
+    CASE(NOT):
+        INLINED(vm[vp - 1] = not(vm[vp - 1]) ? tru : nil);
+
+    CASE(CONS):
+        INLINED(x = cons(vm[vp - 2], vm[vp - 1]); vp -= 2; vm[vp++] = x;
+                RELOAD());
+
+    CASE(CAR):
+        INLINED(vm[vp - 1] = car(vm[vp - 1]));
+
+    CASE(CDR):
+        INLINED(vm[vp - 1] = cdr(vm[vp - 1]));
+
+#undef FOLD
+#undef INLINED
+
+#ifndef THREADED
+    }
+#endif
+
+redefined:
+    /* Insert the new global value bellow the arguments, and call it */
+    vm_push(nil);
+    memmove(vm + vp - n, vm + vp - n - 1, n * sizeof(L));
+    vm[vp - n - 1] = GLOBAL(v);
+    tail           = 0;
+
+call:
+    f = vm[vp - n - 1];
+
+    if (T(f) == CLOS && memoized(f)) {
+        x = nil;
+        PROTECT(x);
+        for (I k = vp; k > vp - n; k--)
+            x = cons(vm[k - 1], x);
+        UNPROTECT(1);
+
+        x = memo_apply(vm[vp - n - 1], x);
+        vp -= n + 1;
+    } else if (T(f) == CLOS) {
+        I i = FRAME_VARS, j = vp - n;
+        d   = frame(car(car(f)), cdr(f));
+        PROTECT(d);
+
+        /* The frame is new, so the arguments can be stored without put() */
+        for (v = ELEM(d, FRAME_NAMES); T(v) == CONS && j < vp; v = cdr(v))
+            SET_ELEM(d, i++, vm[j++]);
+
+        /* Missing arguments are left as ERR, and the rest of the arguments are
+         * bound to the last variable, e.g. (lambda args x) */
+        for (; T(v) == CONS; v = cdr(v))
+            i++;
+
+        if (T(v) != NIL) {
+            x = nil;
+            PROTECT(x);
+            for (I k = vp; k > j; k--)
+                x = cons(vm[k - 1], x);
+            put(d, i, x);
+            UNPROTECT(1);
+        }
+
+        UNPROTECT(1);
+        x = cdr(car(vm[vp - n - 1]));
+        vp -= n + 1;
+
+        if (T(x) == CODE) {
+            if (!tail) {
+                vm_push(code);
+                vm_push(box(0, pc));
+                vm_push(e);
+            }
+
+            code = x;
+            e    = d;
+            pc   = 0;
+            RELOAD();
+            DISPATCH();
+        }
+
+        /* Closure created by the interpreter */
+        if (tail && vp == base) {
+            UNPROTECT(2);
+            *env  = d;
+            *more = 1;
+            return x;
+        }
+
+        x = eval(x, d);
+    } else if (T(f) == PRIM && prim[ord(f)].op != NULL) {
+        x = combine(f, vm + vp - n, n);
+        vp -= n + 1;
+    } else if (T(f) == PRIM) {
+        d = e;
+        PROTECT(d);
+        x = quoted(n);
+        f = vm[vp - n - 1];
+        x = prim[ord(f)].f(x, &d);
+        if (prim[ord(f)].t)
+            x = eval(x, d);
+        UNPROTECT(1);
+        vp -= n + 1;
+    } else {
+        vp -= n + 1;
+#ifdef VERBOSE_ERRORS
+        fprintf(stderr, "[err] %s: not a valid clousure or primitive\n",
+                __func__);
+#endif
+        x = err;
+    }
+
+    vm_push(x);
+    RELOAD();
+
+    if (tail)
+        goto ret;
+
+    DISPATCH();
+}
+
+#undef CASE
+#undef DISPATCH
+#undef THREADED
+#undef RELOAD
+#undef OPERAND
+
+#endif /* BYTECODE_H_ */
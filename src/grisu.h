@@ -0,0 +1,361 @@
+/**
+ * @file      grisu.h
+ * @brief     Shortest formatting of numbers
+ * @author    8dcc
+ *
+ * Implementation of Florian Loitsch's Grisu2 algorithm, see "Printing
+ * Floating-Point Numbers Quickly and Accurately with Integers" (2010). It
+ * produces the shortest (or almost shortest) digits that read back to the same
+ * double, using only 64 bit integer arithmetic. Based on Milo Yip's
+ * implementation.
+ */
+
+#ifndef GRISU_H_
+#define GRISU_H_ 1
+
+/**
+ * @struct Fp
+ * @brief Floating point number `f * 2^e` with a 64 bit significand
+ */
+typedef struct {
+    uint64_t f;
+    int e;
+} Fp;
+
+/* clang-format off */
+
+/**
+ * @name Cached powers
+ * Normalized significands and binary exponents of 10^k, for k from -348 to 340
+ * in steps of 8.
+ */
+static const uint64_t pow10_f[] = {
+    0xfa8fd5a0081c0288ull, 0xbaaee17fa23ebf76ull, 0x8b16fb203055ac76ull,
+    0xcf42894a5dce35eaull, 0x9a6bb0aa55653b2dull, 0xe61acf033d1a45dfull,
+    0xab70fe17c79ac6caull, 0xff77b1fcbebcdc4full, 0xbe5691ef416bd60cull,
+    0x8dd01fad907ffc3cull, 0xd3515c2831559a83ull, 0x9d71ac8fada6c9b5ull,
+    0xea9c227723ee8bcbull, 0xaecc49914078536dull, 0x823c12795db6ce57ull,
+    0xc21094364dfb5637ull, 0x9096ea6f3848984full, 0xd77485cb25823ac7ull,
+    0xa086cfcd97bf97f4ull, 0xef340a98172aace5ull, 0xb23867fb2a35b28eull,
+    0x84c8d4dfd2c63f3bull, 0xc5dd44271ad3cdbaull, 0x936b9fcebb25c996ull,
+    0xdbac6c247d62a584ull, 0xa3ab66580d5fdaf6ull, 0xf3e2f893dec3f126ull,
+    0xb5b5ada8aaff80b8ull, 0x87625f056c7c4a8bull, 0xc9bcff6034c13053ull,
+    0x964e858c91ba2655ull, 0xdff9772470297ebdull, 0xa6dfbd9fb8e5b88full,
+    0xf8a95fcf88747d94ull, 0xb94470938fa89bcfull, 0x8a08f0f8bf0f156bull,
+    0xcdb02555653131b6ull, 0x993fe2c6d07b7facull, 0xe45c10c42a2b3b06ull,
+    0xaa242499697392d3ull, 0xfd87b5f28300ca0eull, 0xbce5086492111aebull,
+    0x8cbccc096f5088ccull, 0xd1b71758e219652cull, 0x9c40000000000000ull,
+    0xe8d4a51000000000ull, 0xad78ebc5ac620000ull, 0x813f3978f8940984ull,
+    0xc097ce7bc90715b3ull, 0x8f7e32ce7bea5c70ull, 0xd5d238a4abe98068ull,
+    0x9f4f2726179a2245ull, 0xed63a231d4c4fb27ull, 0xb0de65388cc8ada8ull,
+    0x83c7088e1aab65dbull, 0xc45d1df942711d9aull, 0x924d692ca61be758ull,
+    0xda01ee641a708deaull, 0xa26da3999aef774aull, 0xf209787bb47d6b85ull,
+    0xb454e4a179dd1877ull, 0x865b86925b9bc5c2ull, 0xc83553c5c8965d3dull,
+    0x952ab45cfa97a0b3ull, 0xde469fbd99a05fe3ull, 0xa59bc234db398c25ull,
+    0xf6c69a72a3989f5cull, 0xb7dcbf5354e9beceull, 0x88fcf317f22241e2ull,
+    0xcc20ce9bd35c78a5ull, 0x98165af37b2153dfull, 0xe2a0b5dc971f303aull,
+    0xa8d9d1535ce3b396ull, 0xfb9b7cd9a4a7443cull, 0xbb764c4ca7a44410ull,
+    0x8bab8eefb6409c1aull, 0xd01fef10a657842cull, 0x9b10a4e5e9913129ull,
+    0xe7109bfba19c0c9dull, 0xac2820d9623bf429ull, 0x80444b5e7aa7cf85ull,
+    0xbf21e44003acdd2dull, 0x8e679c2f5e44ff8full, 0xd433179d9c8cb841ull,
+    0x9e19db92b4e31ba9ull, 0xeb96bf6ebadf77d9ull, 0xaf87023b9bf0ee6bull,
+};
+
+static const int16_t pow10_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+/* clang-format on */
+
+/**
+ * @brief Split the double `x` into its significand and exponent
+ * @param[in] x Positive, finite double
+ * @return Number equal to `x`
+ */
+static Fp fp_of(double x) {
+    const uint64_t bits = *(uint64_t*)&x;
+    const int be        = bits >> 52 & 0x7FF;
+    Fp r;
+
+    r.f = bits & 0xFFFFFFFFFFFFFull;
+    if (be == 0) {
+        r.e = -1074;
+    } else {
+        r.f += 1ull << 52;
+        r.e = be - 1075;
+    }
+
+    return r;
+}
+
+/* shift the significand of x until its highest bit is set */
+static Fp fp_normalize(Fp x) {
+    while (!(x.f & 1ull << 63)) {
+        x.f <<= 1;
+        x.e--;
+    }
+
+    return x;
+}
+
+/**
+ * @brief Multiply two numbers, rounding the 128 bit product of the significands
+ * to its highest 64 bits
+ * @param[in] x First number
+ * @param[in] y Second number
+ * @return Product of `x` and `y`
+ */
+static Fp fp_mul(Fp x, Fp y) {
+    const uint64_t a = x.f >> 32, b = x.f & 0xFFFFFFFF;
+    const uint64_t c = y.f >> 32, d = y.f & 0xFFFFFFFF;
+    const uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t mid = (bd >> 32) + (ad & 0xFFFFFFFF) + (bc & 0xFFFFFFFF);
+    Fp r;
+
+    mid += 1u << 31;
+    r.f = ac + (ad >> 32) + (bc >> 32) + (mid >> 32);
+    r.e = x.e + y.e + 64;
+    return r;
+}
+
+/**
+ * @brief Cached power of ten `c` such that the product of `c` and a number with
+ * binary exponent `e` has an exponent in [-60, -32]
+ * @param[in] e Binary exponent
+ * @param[out] k Decimal exponent of the returned power, negated
+ * @return Normalized power of ten
+ */
+static Fp cached_power(int e, int* k) {
+    const double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int i           = (int)dk;
+    Fp r;
+
+    if (dk - i > 0.0)
+        i++;
+
+    i   = (i >> 3) + 1;
+    *k  = -(-348 + i * 8);
+    r.f = pow10_f[i];
+    r.e = pow10_e[i];
+    return r;
+}
+
+/**
+ * @brief Adjust the last digit of `s` to get closer to the exact value, without
+ * leaving the rounding interval
+ */
+static void grisu_round(char* s, I len, uint64_t delta, uint64_t rest,
+                        uint64_t ten_kappa, uint64_t wp_w) {
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        s[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+/**
+ * @brief Generate the digits of `w` that are inside the interval of width
+ * `delta` bellow `mp`
+ * @param[in] w Scaled number
+ * @param[in] mp Scaled upper boundary of the number
+ * @param[in] delta Width of the rounding interval
+ * @param[out] s Digits
+ * @param[in,out] k Decimal exponent of the digits
+ * @return Number of digits
+ */
+static I grisu_digits(Fp w, Fp mp, uint64_t delta, char* s, int* k) {
+    static const uint64_t pow10[] = {
+        1ull,
+        10ull,
+        100ull,
+        1000ull,
+        10000ull,
+        100000ull,
+        1000000ull,
+        10000000ull,
+        100000000ull,
+        1000000000ull,
+        10000000000ull,
+        100000000000ull,
+        1000000000000ull,
+        10000000000000ull,
+        100000000000000ull,
+        1000000000000000ull,
+        10000000000000000ull,
+        100000000000000000ull,
+        1000000000000000000ull,
+        10000000000000000000ull,
+    };
+    const int shift     = -mp.e;
+    const uint64_t one  = 1ull << shift;
+    const uint64_t wp_w = mp.f - w.f;
+    uint32_t p1         = mp.f >> shift;
+    uint64_t p2         = mp.f & (one - 1);
+    int kappa           = 1;
+    I len               = 0;
+
+    while (kappa < 10 && p1 >= pow10[kappa])
+        kappa++;
+
+    /* Integral part */
+    while (kappa > 0) {
+        const uint32_t d = p1 / pow10[kappa - 1];
+        p1 %= pow10[kappa - 1];
+
+        if (d || len)
+            s[len++] = '0' + d;
+
+        kappa--;
+        const uint64_t rest = ((uint64_t)p1 << shift) + p2;
+        if (rest <= delta) {
+            *k += kappa;
+            grisu_round(s, len, delta, rest, pow10[kappa] << shift, wp_w);
+            return len;
+        }
+    }
+
+    /* Fractional part */
+    while (1) {
+        p2 *= 10;
+        delta *= 10;
+
+        const char d = p2 >> shift;
+        if (d || len)
+            s[len++] = '0' + d;
+
+        p2 &= one - 1;
+        kappa--;
+        if (p2 < delta) {
+            *k += kappa;
+            grisu_round(s, len, delta, p2, one,
+                        -kappa < 20 ? wp_w * pow10[-kappa] : 0);
+            return len;
+        }
+    }
+}
+
+/**
+ * @brief Shortest digits of the double `x`
+ * @param[in] x Positive, finite, non-zero double
+ * @param[out] s At least 18 characters for the digits
+ * @param[out] k Decimal exponent, so `x` is about `s * 10^k`
+ * @return Number of digits
+ */
+static I grisu2(double x, char* s, int* k) {
+    const Fp v = fp_of(x);
+    Fp mp, mm, c, w;
+
+    /* Boundaries of the numbers that round to x, halfway to its neighbours */
+    mp.f = (v.f << 1) + 1;
+    mp.e = v.e - 1;
+    while (!(mp.f & 1ull << 53)) {
+        mp.f <<= 1;
+        mp.e--;
+    }
+    mp.f <<= 10;
+    mp.e -= 10;
+
+    if (v.f == 1ull << 52) {
+        mm.f = (v.f << 2) - 1;
+        mm.e = v.e - 2;
+    } else {
+        mm.f = (v.f << 1) - 1;
+        mm.e = v.e - 1;
+    }
+    mm.f <<= mm.e - mp.e;
+    mm.e = mp.e;
+
+    /* Scale everything by a power of ten, so the digits fit in 64 bits */
+    c  = cached_power(mp.e, k);
+    w  = fp_mul(fp_normalize(v), c);
+    mp = fp_mul(mp, c);
+    mm = fp_mul(mm, c);
+    mm.f++;
+    mp.f--;
+
+    return grisu_digits(w, mp, mp.f - mm.f, s, k);
+}
+
+/**
+ * @brief Format the number `x` with the shortest digits that read back to it
+ * @details Integers are formatted directly. Other numbers use decimal notation
+ * for exponents from -6 to 20, and scientific notation otherwise, like printf's
+ * `%g`.
+ * @param[in] x Number
+ * @param[out] s At least 32 characters
+ * @return Length of the formatted number
+ */
+static I format_num(double x, char* s) {
+    I len = 0, n;
+    int k, kk;
+
+    if (x != x || x - x != 0)
+        return snprintf(s, 32, "%g", x);
+
+    /* The sign bit, so -0 is formatted as -0 */
+    if (*(uint64_t*)&x >> 63) {
+        s[len++] = '-';
+        x        = -x;
+    }
+
+    /* Integer fast path, the digits are written backwards */
+    if (x < 9007199254740992.0 && x == (double)(uint64_t)x) {
+        uint64_t i = x;
+        char tmp[20];
+
+        n = 0;
+        do {
+            tmp[n++] = '0' + i % 10;
+            i /= 10;
+        } while (i > 0);
+
+        while (n > 0)
+            s[len++] = tmp[--n];
+
+        return len;
+    }
+
+    s += len;
+    n  = grisu2(x, s, &k);
+    kk = n + k;
+
+    if (k >= 0 && kk <= 21) {
+        /* 1234e7 -> 12340000000 */
+        for (; (int)n < kk; n++)
+            s[n] = '0';
+    } else if (kk > 0 && kk <= 21) {
+        /* 1234e-2 -> 12.34 */
+        memmove(s + kk + 1, s + kk, n - kk);
+        s[kk] = '.';
+        n++;
+    } else if (kk > -6 && kk <= 0) {
+        /* 1234e-6 -> 0.001234 */
+        const int offset = 2 - kk;
+        memmove(s + offset, s, n);
+        s[0] = '0';
+        s[1] = '.';
+        for (int i = 2; i < offset; i++)
+            s[i] = '0';
+        n += offset;
+    } else {
+        /* 1234e30 -> 1.234e+33 */
+        if (n > 1) {
+            memmove(s + 2, s + 1, n - 1);
+            s[1] = '.';
+            n++;
+        }
+        n += snprintf(s + n, 8, "e%+03d", kk - 1);
+    }
+
+    return len + n;
+}
+
+#endif /* GRISU_H_ */
@@ -0,0 +1,61 @@
+/**
+ * @file      libtinylisp.h
+ * @brief     Interface of the TinyLisp library
+ * @author    8dcc
+ *
+ * Built with `make lib`, as libtinylisp.a. Each interpreter created by tl_new()
+ * has its own cell space and global environment, so a program can keep many of
+ * them. An interpreter must not be used by two threads at the same time, but
+ * different threads can use different interpreters concurrently.
+ */
+
+#ifndef LIBTINYLISP_H_
+#define LIBTINYLISP_H_ 1
+
+/**
+ * @struct TinyLisp
+ * @brief An interpreter, only used through pointers returned by tl_new()
+ */
+typedef struct TinyLisp TinyLisp;
+
+/**
+ * @name Interpreter flags
+ * Flags for tl_new(), like the arguments of the REPL.
+ *
+ * TL_GROW: grow the cell space when full, instead of aborting (`-g`).
+ *
+ * TL_COMPILE: compile closures to bytecode (`-c`).
+ */
+#define TL_GROW    1u
+#define TL_COMPILE 2u
+
+/**
+ * @brief Create an interpreter with the primitives in its global environment
+ * @param[in] cells Initial number of cells, or 0 for the default of the REPL
+ * @param[in] flags Combination of TL_GROW and TL_COMPILE
+ * @return New interpreter, or NULL if it couldn't be allocated, or if `cells`
+ * are too few for the primitives
+ */
+TinyLisp* tl_new(unsigned cells, unsigned flags);
+
+/**
+ * @brief Evaluate the expressions in `src`, in the global environment of `tl`
+ * @details The definitions stay in the interpreter for the next calls. An
+ * incomplete expression at the end of `src` is ignored, and `(quit)` stops the
+ * evaluation of the rest.
+ * @param[in] tl Interpreter
+ * @param[in] src Source code, a null-terminated string
+ * @return The printed values of the expressions, one per line. Owned by the
+ * interpreter, and valid until the next call with it. NULL if the cell space
+ * ran out of memory, in which case the evaluation is stopped, but the
+ * interpreter can still be used or freed.
+ */
+const char* tl_eval_string(TinyLisp* tl, const char* src);
+
+/**
+ * @brief Free an interpreter created by tl_new()
+ * @param[in] tl Interpreter, can be NULL
+ */
+void tl_free(TinyLisp* tl);
+
+#endif    // LIBTINYLISP_H_
@@ -40,166 +40,552 @@
  *        y)            sequentially binds each variable v1 to xi to evaluate y
  *  (lambda v x)        construct a closure
  *  (define v x)        define a named value globally
- *  (quit)              exit the REPL
+ *  (make-vector n x)   construct a vector of n elements, initially x (or ())
+ *  (make-array n x)    construct an array of n numbers, initially x (or 0)
+ *  (vector-ref v k)    element k of vector or array v
+ *  (vector-set! v k x) set element k of vector or array v to x, returns x
+ *  (vector-length v)   number of elements of vector or array v
+ *  (vsum a)            sum of the numbers of array a
+ *  (vdot a b)          sum of the products of the numbers of arrays a and b
+ *  (vadd a b)          new array with the sums of the numbers of a and b
+ *  (vmul a b)          new array with the products of the numbers of a and b
+ *  (vmap-scale a n)    new array with the numbers of a multiplied by n
+ *  (make-hash)         construct an empty hash table
+ *  (hash-get h k d)    value of key k in hash table h, or d (or ()) if missing
+ *  (hash-put h k x)    set the value of key k in hash table h to x, returns x
+ *  (hash-remove h k)   #t if key k was removed from hash table h, otherwise ()
+ *  (hash-count h)      number of keys in hash table h
+ *  (memoize f n)       closure f caching up to n (or 128) results by arguments
+ *  (pmap f t)          list of f applied to each element of t, in parallel
+ *  (spawn x)           special form, future of x, evaluated in parallel
+ *  (touch x)           value of the future x, waiting for it (or x itself)
+ *  (profile-report)    print the calls profiled so far, see `-p`
+ *  (stats)             print the allocation and collection statistics
+ *  (quit)              exit the REPL, or stop tl_eval_string()
  */
 
-static L f_eval(L t, L e) {
-    return eval(car(evlis(t, e)), e);
+static L f_eval(L t, L* e) {
+    return car(evlis(t, *e));
 }
 
-static L f_quote(L t, L e) {
+static L f_quote(L t, L* e) {
     (void)e;
     return car(t);
 }
 
-static L f_cons(L t, L e) {
-    t = evlis(t, e);
-    return cons(car(t), car(cdr(t)));
-}
+/*
+ * Operations of the primitives that only need the values of their arguments.
+ * They are applied by apply() to arguments evaluated into local variables,
+ * without consing a list of values. See PrimPair.
+ */
 
-static L f_car(L t, L e) {
-    return car(car(evlis(t, e)));
+static L op_cons(L x, L y) {
+    return cons(x, y);
 }
 
-static L f_cdr(L t, L e) {
-    return cdr(car(evlis(t, e)));
+static L op_car(L x, L y) {
+    (void)y;
+    return car(x);
 }
 
-static L f_add(L t, L e) {
-    L n;
-    t = evlis(t, e);
-    n = car(t);
-
-    while (!not(t = cdr(t)))
-        n += car(t);
-
-    return num(n);
+static L op_cdr(L x, L y) {
+    (void)y;
+    return cdr(x);
 }
 
-static L f_sub(L t, L e) {
-    L n;
-    t = evlis(t, e);
-    n = car(t);
-
-    while (!not(t = cdr(t)))
-        n -= car(t);
-
-    return num(n);
+static L op_add(L x, L y) {
+    return num(x + y);
 }
 
-static L f_mul(L t, L e) {
-    L n;
-    t = evlis(t, e);
-    n = car(t);
-
-    while (!not(t = cdr(t)))
-        n *= car(t);
-
-    return num(n);
+static L op_sub(L x, L y) {
+    return num(x - y);
 }
 
-static L f_div(L t, L e) {
-    L n;
-    t = evlis(t, e);
-    n = car(t);
-
-    while (!not(t = cdr(t)))
-        n /= car(t);
+static L op_mul(L x, L y) {
+    return num(x * y);
+}
 
-    return num(n);
+static L op_div(L x, L y) {
+    return num(x / y);
 }
 
-static L f_int(L t, L e) {
-    L n = car(evlis(t, e));
+static L op_int(L n, L y) {
+    (void)y;
     if (n < 1e16 && n > -1e16)
         return (int64_t)n;
     else
         return n;
 }
 
-static L f_lt(L t, L e) {
-    t = evlis(t, e);
-    if (car(t) - car(cdr(t)) < 0)
+static L op_lt(L x, L y) {
+    if (x < y)
         return tru;
     else
         return nil;
 }
 
-static L f_eq(L t, L e) {
-    t = evlis(t, e);
-    if (equ(car(t), car(cdr(t))))
+static L op_eq(L x, L y) {
+    if (equ(x, y))
         return tru;
     else
         return nil;
 }
 
-static L f_not(L t, L e) {
-    if (not(car(evlis(t, e))))
+static L op_not(L x, L y) {
+    (void)y;
+    if (not(x))
         return tru;
     else
         return nil;
 }
 
-static L f_or(L t, L e) {
+static L f_cons(L t, L* e) {
+    return apply(op_cons, 2, t, *e);
+}
+
+static L f_car(L t, L* e) {
+    return apply(op_car, 1, t, *e);
+}
+
+static L f_cdr(L t, L* e) {
+    return apply(op_cdr, 1, t, *e);
+}
+
+static L f_add(L t, L* e) {
+    return apply(op_add, VARIADIC, t, *e);
+}
+
+static L f_sub(L t, L* e) {
+    return apply(op_sub, VARIADIC, t, *e);
+}
+
+static L f_mul(L t, L* e) {
+    return apply(op_mul, VARIADIC, t, *e);
+}
+
+static L f_div(L t, L* e) {
+    return apply(op_div, VARIADIC, t, *e);
+}
+
+static L f_int(L t, L* e) {
+    return apply(op_int, 1, t, *e);
+}
+
+static L f_lt(L t, L* e) {
+    return apply(op_lt, 2, t, *e);
+}
+
+static L f_eq(L t, L* e) {
+    return apply(op_eq, 2, t, *e);
+}
+
+static L f_not(L t, L* e) {
+    return apply(op_not, 1, t, *e);
+}
+
+static L f_or(L t, L* e) {
     L x = nil;
+    PROTECT(t);
 
-    while (T(t) != NIL && not(x = eval(car(t), e)))
+    while (T(t) != NIL && not(x = eval(car(t), *e)))
         t = cdr(t);
 
+    UNPROTECT(1);
     return x;
 }
 
-static L f_and(L t, L e) {
+static L f_and(L t, L* e) {
     L x = nil;
+    PROTECT(t);
 
-    while (T(t) != NIL && !not(x = eval(car(t), e)))
+    while (T(t) != NIL && !not(x = eval(car(t), *e)))
         t = cdr(t);
 
+    UNPROTECT(1);
     return x;
 }
 
-static L f_cond(L t, L e) {
-    while (T(t) != NIL && not(eval(car(car(t)), e)))
+static L f_cond(L t, L* e) {
+    PROTECT(t);
+
+    while (T(t) != NIL && not(eval(car(car(t)), *e)))
         t = cdr(t);
 
-    return eval(car(cdr(car(t))), e);
+    UNPROTECT(1);
+    return car(cdr(car(t)));
 }
 
-static L f_if(L t, L e) {
-    return eval(car(cdr(not(eval(car(t), e)) ? cdr(t) : t)), e);
+static L f_if(L t, L* e) {
+    L x;
+    PROTECT(t);
+    x = eval(car(t), *e);
+    UNPROTECT(1);
+    return car(cdr(not(x) ? cdr(t) : t));
 }
 
-static L f_leta(L t, L e) {
-    for (; let(t); t = cdr(t))
-        e = pair(car(car(t)), eval(car(cdr(car(t))), e), e);
+static L f_leta(L t, L* e) {
+    L x;
+    PROTECT(t);
+
+    for (; let(t); t = cdr(t)) {
+        x  = eval(car(cdr(car(t))), *e);
+        *e = bind(car(car(t)), x, *e);
+    }
 
-    return eval(car(t), e);
+    UNPROTECT(1);
+    return car(t);
 }
 
-static L f_lambda(L t, L e) {
-    return closure(car(t), car(cdr(t)), e);
+static L f_lambda(L t, L* e) {
+    L x = car(cdr(t));
+
+    /* Compile the body to bytecode, see compile(). Resolve the local variables
+     * of the body otherwise, unless it was already resolved as part of an
+     * enclosing closure (see resolve) */
+    if (compiling) {
+        PROTECT(t);
+        x = compile(car(t), x, nil, *e);
+        UNPROTECT(1);
+    } else if (!equ(cdr(cdr(t)), tru)) {
+        PROTECT(t);
+        x = cons(car(t), nil);
+        x = resolve(car(cdr(t)), x, *e);
+        UNPROTECT(1);
+    }
+
+    return closure(car(t), x, *e);
 }
 
-static L f_define(L t, L e) {
-    env = pair(car(t), eval(car(cdr(t)), e), env);
-    return car(t);
+static L f_define(L t, L* e) {
+    L v = car(t), x;
+
+    if (T(v) != ATOM)
+        err_msg("can't define a non-atom");
+
+    x = eval(car(cdr(t)), *e);
+    define(v, x);
+
+    if (profiling)
+        profile_define(v, x);
+
+    return v;
+}
+
+static L f_make_vector(L t, L* e) {
+    L n, x;
+    t = evlis(t, *e);
+    n = car(t);
+    x = cdr(t);
+
+    if (!(n >= 0 && n < BLOCK_SIZE && fits(n)))
+        err_msg("invalid vector size");
+
+    return block(VEC, n, T(x) == CONS ? car(x) : nil);
+}
+
+static L f_make_array(L t, L* e) {
+    L n, x;
+    t = evlis(t, *e);
+    n = car(t);
+    x = cdr(t);
+    x = T(x) == CONS ? car(x) : 0;
+
+    /* Any tagged expression is a NaN, so `x == x` only holds for numbers */
+    if (!(n >= 0 && n < BLOCK_SIZE && fits(ARRAY_CELLS((uint64_t)n))) ||
+        x != x)
+        err_msg("invalid array size or element");
+
+    return array(n, x);
+}
+
+static L f_vector_ref(L t, L* e) {
+    L v, k;
+    t = evlis(t, *e);
+    v = car(t);
+    k = car(cdr(t));
+
+    if ((T(v) != VEC && T(v) != ARR) || !(k >= 0 && k < size(v)))
+        err_msg("invalid vector or index");
+
+    return T(v) == VEC ? ELEM(v, (I)k) : AREF(v, (I)k);
+}
+
+static L f_vector_set(L t, L* e) {
+    L v, k, x;
+    t = evlis(t, *e);
+    v = car(t);
+    k = car(cdr(t));
+    x = car(cdr(cdr(t)));
+
+    if ((T(v) != VEC && T(v) != ARR) || !(k >= 0 && k < size(v)))
+        err_msg("invalid vector or index");
+
+    if (T(v) == VEC) {
+        put(v, k, x);
+    } else {
+        if (x != x)
+            err_msg("arrays can only contain numbers");
+
+        AREF(v, (I)k) = x;
+    }
+
+    return x;
+}
+
+static L f_vector_length(L t, L* e) {
+    L v = car(evlis(t, *e));
+
+    if (T(v) != VEC && T(v) != ARR)
+        err_msg("not a vector");
+
+    return size(v);
+}
+
+static L f_vsum(L t, L* e) {
+    L a = car(evlis(t, *e));
+
+    if (T(a) != ARR)
+        err_msg("not an array");
+
+    return num(simd_sum(elems(a), size(a)));
+}
+
+static L f_vdot(L t, L* e) {
+    L a, b;
+    t = evlis(t, *e);
+    a = car(t);
+    b = car(cdr(t));
+
+    if (T(a) != ARR || T(b) != ARR || size(a) != size(b))
+        err_msg("invalid arrays");
+
+    return num(simd_dot(elems(a), elems(b), size(a)));
+}
+
+static L f_vadd(L t, L* e) {
+    L a, b, r;
+    t = evlis(t, *e);
+    a = car(t);
+    b = car(cdr(t));
+
+    if (T(a) != ARR || T(b) != ARR || size(a) != size(b))
+        err_msg("invalid arrays");
+
+    PROTECT(a);
+    PROTECT(b);
+    r = array(size(a), 0);
+    UNPROTECT(2);
+
+    simd_add(elems(r), elems(a), elems(b), size(r));
+    return r;
+}
+
+static L f_vmul(L t, L* e) {
+    L a, b, r;
+    t = evlis(t, *e);
+    a = car(t);
+    b = car(cdr(t));
+
+    if (T(a) != ARR || T(b) != ARR || size(a) != size(b))
+        err_msg("invalid arrays");
+
+    PROTECT(a);
+    PROTECT(b);
+    r = array(size(a), 0);
+    UNPROTECT(2);
+
+    simd_mul(elems(r), elems(a), elems(b), size(r));
+    return r;
+}
+
+static L f_vmap_scale(L t, L* e) {
+    L a, n, r;
+    t = evlis(t, *e);
+    a = car(t);
+    n = car(cdr(t));
+
+    if (T(a) != ARR || n != n)
+        err_msg("invalid array or factor");
+
+    PROTECT(a);
+    r = array(size(a), 0);
+    UNPROTECT(1);
+
+    simd_scale(elems(r), elems(a), n, size(r));
+    return r;
 }
 
-static L f_quit(L t, L e) {
+static L f_make_hash(L t, L* e) {
     (void)t;
     (void)e;
 
-    puts("Goodbye!");
-    exit(0);
+    return table();
+}
+
+static L f_hash_get(L t, L* e) {
+    L h, d;
+    t = evlis(t, *e);
+    h = car(t);
+    d = cdr(cdr(t));
+
+    if (T(h) != HASH)
+        err_msg("not a hash table");
+
+    return hash_get(h, car(cdr(t)), T(d) == CONS ? car(d) : nil);
+}
+
+static L f_hash_put(L t, L* e) {
+    L h, x;
+    t = evlis(t, *e);
+    h = car(t);
+    x = car(cdr(cdr(t)));
+
+    if (T(h) != HASH)
+        err_msg("not a hash table");
+
+    hash_put(h, car(cdr(t)), x);
+    return x;
+}
+
+static L f_hash_remove(L t, L* e) {
+    L h;
+    t = evlis(t, *e);
+    h = car(t);
+
+    if (T(h) != HASH)
+        err_msg("not a hash table");
+
+    if (hash_remove(h, car(cdr(t))))
+        return tru;
+    else
+        return nil;
+}
+
+static L f_hash_count(L t, L* e) {
+    L h = car(evlis(t, *e));
+
+    if (T(h) != HASH)
+        err_msg("not a hash table");
+
+    return ord(ELEM(h, HASH_COUNT));
+}
+
+static L f_memoize(L t, L* e) {
+    L f, n;
+    t = evlis(t, *e);
+    f = car(t);
+    n = cdr(t);
+    n = T(n) == CONS ? car(n) : MEMO_ENTRIES;
+
+    if (T(f) != CLOS)
+        err_msg("not a valid clousure");
+
+    if (!(n >= 1 && n < BLOCK_SIZE / (4 * MEMO_WAYS)))
+        err_msg("invalid cache size");
+
+    return memoize(f, n);
+}
+
+static L f_pmap(L t, L* e) {
+    L f;
+    t = evlis(t, *e);
+    f = car(t);
+    t = car(cdr(t));
+
+    if (T(f) != CLOS && T(f) != PRIM)
+        err_msg("not a valid clousure or primitive");
+
+    return pmap(f, t);
+}
+
+static L f_spawn(L t, L* e) {
+    return spawn(car(t), *e);
+}
+
+static L f_touch(L t, L* e) {
+    return touch(car(evlis(t, *e)));
+}
+
+static L f_for_each_form(L t, L* e) {
+    L f, path;
+    t    = evlis(t, *e);
+    f    = car(t);
+    path = car(cdr(t));
+
+    if (T(f) != CLOS && T(f) != PRIM)
+        err_msg("not a valid clousure or primitive");
+
+    if (T(path) != ATOM)
+        err_msg("not a valid path");
+
+    return forms(f, nil, path, 0);
+}
+
+static L f_fold_forms(L t, L* e) {
+    L f, x, path;
+    t    = evlis(t, *e);
+    f    = car(t);
+    x    = car(cdr(t));
+    path = car(cdr(cdr(t)));
+
+    if (T(f) != CLOS && T(f) != PRIM)
+        err_msg("not a valid clousure or primitive");
+
+    if (T(path) != ATOM)
+        err_msg("not a valid path");
+
+    return forms(f, x, path, 1);
+}
+
+static L f_profile_report(L t, L* e) {
+    (void)t;
+    (void)e;
+
+    if (!profiling)
+        err_msg("profiling is not enabled");
+
+    profile_report(NULL);
+    return tru;
+}
+
+static L f_stats(L t, L* e) {
+    (void)t;
+    (void)e;
+
+    print_stats(NULL);
+    return tru;
+}
+
+static L f_quit(L t, L* e) {
+    (void)t;
+    (void)e;
+
+    out_str("Goodbye!\n");
+    stop();
 }
 
 /**
  * @struct PrimPair
- * @details Asociates a name `s` to a function pointer `f`
+ * @details Asociates a name `s` to a function pointer `f`. The primitives
+ * receive the unevaluated arguments and a pointer to the environment, which
+ * they can extend (e.g. let*).
+ *
+ * If `t` is non-zero, the primitive doesn't evaluate its last expression, but
+ * returns it so eval() can evaluate it in the (possibly modified) environment
+ * without recursing. This way, tail calls in `if`, `cond`, `let*` and `eval`
+ * don't grow the C stack.
+ *
+ * If `op` is not NULL, the primitive only needs the values of its `n`
+ * arguments (or of any number of them if `n` is VARIADIC), and eval() and
+ * exec() apply `op` to them directly, without calling `f` nor consing a list
+ * of values. See apply() and combine().
  */
 typedef struct {
-    const char* s; /* Primitive name */
-    L (*f)(L, L);  /* Pointer to primitive function declared above */
+    const char* s;  /* Primitive name */
+    L (*f)(L, L*);  /* Pointer to primitive function declared above */
+    I t;            /* Non-zero if the returned expression is a tail call */
+    L (*op)(L, L);  /* Operation on the values of the arguments, or NULL */
+    I n;            /* Number of arguments of `op`, or VARIADIC */
 } PrimPair;
 
 /* clang-format off */
@@ -208,29 +594,52 @@ typedef struct {
  * @var prim
  * @brief Table of Lisp primitives
  */
-PrimPair prim[] = {
-    { "eval",   f_eval },
-    { "quote",  f_quote },
-    { "cons",   f_cons },
-    { "car",    f_car },
-    { "cdr",    f_cdr },
-    { "+",      f_add },
-    { "-",      f_sub },
-    { "*",      f_mul },
-    { "/",      f_div },
-    { "int",    f_int },
-    { "<",      f_lt },
-    { "equ",    f_eq },
-    { "or",     f_or },
-    { "and",    f_and },
-    { "not",    f_not },
-    { "cond",   f_cond },
-    { "if",     f_if },
-    { "let*",   f_leta },
-    { "lambda", f_lambda },
-    { "define", f_define },
-    { "quit",   f_quit },
-    { NULL,     NULL },
+static PrimPair prim[] = {
+    { "eval",           f_eval,           1, NULL,    0 },
+    { "quote",          f_quote,          0, NULL,    0 },
+    { "cons",           f_cons,           0, op_cons, 2 },
+    { "car",            f_car,            0, op_car,  1 },
+    { "cdr",            f_cdr,            0, op_cdr,  1 },
+    { "+",              f_add,            0, op_add,  VARIADIC },
+    { "-",              f_sub,            0, op_sub,  VARIADIC },
+    { "*",              f_mul,            0, op_mul,  VARIADIC },
+    { "/",              f_div,            0, op_div,  VARIADIC },
+    { "int",            f_int,            0, op_int,  1 },
+    { "<",              f_lt,             0, op_lt,   2 },
+    { "equ",            f_eq,             0, op_eq,   2 },
+    { "or",             f_or,             0, NULL,    0 },
+    { "and",            f_and,            0, NULL,    0 },
+    { "not",            f_not,            0, op_not,  1 },
+    { "cond",           f_cond,           1, NULL,    0 },
+    { "if",             f_if,             1, NULL,    0 },
+    { "let*",           f_leta,           1, NULL,    0 },
+    { "lambda",         f_lambda,         0, NULL,    0 },
+    { "define",         f_define,         0, NULL,    0 },
+    { "make-vector",    f_make_vector,    0, NULL,    0 },
+    { "make-array",     f_make_array,     0, NULL,    0 },
+    { "vector-ref",     f_vector_ref,     0, NULL,    0 },
+    { "vector-set!",    f_vector_set,     0, NULL,    0 },
+    { "vector-length",  f_vector_length,  0, NULL,    0 },
+    { "vsum",           f_vsum,           0, NULL,    0 },
+    { "vdot",           f_vdot,           0, NULL,    0 },
+    { "vadd",           f_vadd,           0, NULL,    0 },
+    { "vmul",           f_vmul,           0, NULL,    0 },
+    { "vmap-scale",     f_vmap_scale,     0, NULL,    0 },
+    { "make-hash",      f_make_hash,      0, NULL,    0 },
+    { "hash-get",       f_hash_get,       0, NULL,    0 },
+    { "hash-put",       f_hash_put,       0, NULL,    0 },
+    { "hash-remove",    f_hash_remove,    0, NULL,    0 },
+    { "hash-count",     f_hash_count,     0, NULL,    0 },
+    { "memoize",        f_memoize,        0, NULL,    0 },
+    { "pmap",           f_pmap,           0, NULL,    0 },
+    { "spawn",          f_spawn,          0, NULL,    0 },
+    { "touch",          f_touch,          0, NULL,    0 },
+    { "for-each-form",  f_for_each_form,  0, NULL,    0 },
+    { "fold-forms",     f_fold_forms,     0, NULL,    0 },
+    { "profile-report", f_profile_report, 0, NULL,    0 },
+    { "stats",          f_stats,          0, NULL,    0 },
+    { "quit",           f_quit,           0, NULL,    0 },
+    { NULL,             NULL,             0, NULL,    0 },
 };
 
 /* clang-format on */
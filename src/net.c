@@ -0,0 +1,94 @@
+/**
+ * @file      net.c
+ * @brief     Sockets of the server
+ * @author    8dcc
+ *
+ * See net.h.
+ */
+
+#define _GNU_SOURCE /* accept4() */
+
+#include <netdb.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "net.h"
+
+int net_listen(const char* addr) {
+    const char* port = strrchr(addr, ':');
+    struct addrinfo hints = { 0 }, *res, *p;
+    char host[256];
+    int fd = -1, yes = 1;
+
+    if (strchr(addr, '/') != NULL) {
+        struct sockaddr_un sa = { .sun_family = AF_UNIX };
+        struct stat st;
+
+        if (strlen(addr) >= sizeof(sa.sun_path))
+            return -1;
+        strcpy(sa.sun_path, addr);
+
+        if (stat(addr, &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(addr);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0 ||
+                        listen(fd, SOMAXCONN) != 0)) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    if (port == NULL) {
+        port    = addr;
+        host[0] = '\0';
+    } else if ((size_t)(port - addr) >= sizeof(host)) {
+        return -1;
+    } else {
+        memcpy(host, addr, port - addr);
+        host[port - addr] = '\0';
+        port++;
+    }
+
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(*host ? host : "127.0.0.1", port, &hints, &res) != 0)
+        return -1;
+
+    for (p = res; p != NULL && fd < 0; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    p->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(fd, p->ai_addr, p->ai_addrlen) != 0 ||
+            listen(fd, SOMAXCONN) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    freeaddrinfo(res);
+    return fd;
+}
+
+int net_accept(int fd) {
+    return accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+ssize_t net_recv(int fd, char* p, size_t n) {
+    return recv(fd, p, n, 0);
+}
+
+ssize_t net_send(int fd, const char* p, size_t n) {
+    return send(fd, p, n, MSG_NOSIGNAL);
+}
+
+void net_close(int fd) {
+    close(fd);
+}
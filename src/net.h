@@ -0,0 +1,52 @@
+/**
+ * @file      net.h
+ * @brief     Sockets of the server
+ * @author    8dcc
+ *
+ * The system headers of the sockets declare read() and bind(), which are also
+ * the names of functions of the interpreter, so they are only included by
+ * net.c. See serve().
+ */
+
+#ifndef NET_H_
+#define NET_H_ 1
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * @brief Open a socket listening on `addr`
+ * @details If `addr` contains a `/`, it's the path of a Unix socket, which
+ * replaces the socket of a previous server. Otherwise it's `[HOST:]PORT`, and
+ * the host is the loopback interface (127.0.0.1) by default.
+ * @param[in] addr Address to listen on
+ * @return Non-blocking socket, or -1 on error
+ */
+int net_listen(const char* addr);
+
+/**
+ * @brief Accept a pending connection of the listening socket `fd`
+ * @param[in] fd Listening socket
+ * @return Non-blocking socket of the connection, or -1 with `errno` set
+ */
+int net_accept(int fd);
+
+/**
+ * @brief Receive up to `n` bytes from the socket `fd` into `p`
+ * @return Number of bytes received, 0 at the end, or -1 with `errno` set
+ */
+ssize_t net_recv(int fd, char* p, size_t n);
+
+/**
+ * @brief Send up to `n` bytes at `p` to the socket `fd`
+ * @details Doesn't raise SIGPIPE if the other side was closed.
+ * @return Number of bytes sent, or -1 with `errno` set
+ */
+ssize_t net_send(int fd, const char* p, size_t n);
+
+/**
+ * @brief Close the socket `fd`
+ */
+void net_close(int fd);
+
+#endif    // NET_H_
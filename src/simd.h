@@ -0,0 +1,173 @@
+/**
+ * @file      simd.h
+ * @brief     Vectorized kernels over arrays of numbers
+ * @author    8dcc
+ *
+ * Loops used by the array primitives, see array(). They work on contiguous
+ * doubles, so they are written with SSE2 intrinsics (always available on
+ * x86-64), or AVX ones if the compiler targets it (e.g. `-mavx`). On other
+ * architectures, the portable loops are used, which the compiler can vectorize
+ * on its own with optimizations enabled.
+ *
+ * The elements are not required to be aligned. Reductions use several
+ * accumulators, so the rounding of a sum can differ slightly from the one of a
+ * left to right sum.
+ */
+
+#ifndef SIMD_H_
+#define SIMD_H_ 1
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Sum of the `k` numbers at `a`
+ * @param[in] a Numbers
+ * @param[in] k Number of elements
+ * @return Sum
+ */
+static L simd_sum(const L* a, I k) {
+    I j = 0;
+    L n = 0;
+
+#if defined(__AVX__)
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    for (; j + 8 <= k; j += 8) {
+        s0 = _mm256_add_pd(s0, _mm256_loadu_pd(a + j));
+        s1 = _mm256_add_pd(s1, _mm256_loadu_pd(a + j + 4));
+    }
+    s0 = _mm256_add_pd(s0, s1);
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(s0),
+                           _mm256_extractf128_pd(s0, 1));
+    n = _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+#elif defined(__SSE2__)
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    for (; j + 4 <= k; j += 4) {
+        s0 = _mm_add_pd(s0, _mm_loadu_pd(a + j));
+        s1 = _mm_add_pd(s1, _mm_loadu_pd(a + j + 2));
+    }
+    s0 = _mm_add_pd(s0, s1);
+    n  = _mm_cvtsd_f64(_mm_add_sd(s0, _mm_unpackhi_pd(s0, s0)));
+#endif
+
+    for (; j < k; j++)
+        n += a[j];
+
+    return n;
+}
+
+/**
+ * @brief Dot product of the `k` numbers at `a` and `b`
+ * @param[in] a Numbers
+ * @param[in] b Numbers
+ * @param[in] k Number of elements of each one
+ * @return Sum of the products
+ */
+static L simd_dot(const L* a, const L* b, I k) {
+    I j = 0;
+    L n = 0;
+
+#if defined(__AVX__)
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    for (; j + 8 <= k; j += 8) {
+        s0 = _mm256_add_pd(
+          s0, _mm256_mul_pd(_mm256_loadu_pd(a + j), _mm256_loadu_pd(b + j)));
+        s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(a + j + 4),
+                                             _mm256_loadu_pd(b + j + 4)));
+    }
+    s0 = _mm256_add_pd(s0, s1);
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(s0),
+                           _mm256_extractf128_pd(s0, 1));
+    n = _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+#elif defined(__SSE2__)
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    for (; j + 4 <= k; j += 4) {
+        s0 = _mm_add_pd(s0,
+                        _mm_mul_pd(_mm_loadu_pd(a + j), _mm_loadu_pd(b + j)));
+        s1 = _mm_add_pd(
+          s1, _mm_mul_pd(_mm_loadu_pd(a + j + 2), _mm_loadu_pd(b + j + 2)));
+    }
+    s0 = _mm_add_pd(s0, s1);
+    n  = _mm_cvtsd_f64(_mm_add_sd(s0, _mm_unpackhi_pd(s0, s0)));
+#endif
+
+    for (; j < k; j++)
+        n += a[j] * b[j];
+
+    return n;
+}
+
+/**
+ * @brief Store the sums of the `k` numbers at `a` and `b` in `r`
+ * @param[out] r Result, can be the same as `a` or `b`
+ * @param[in] a Numbers
+ * @param[in] b Numbers
+ * @param[in] k Number of elements of each one
+ */
+static void simd_add(L* r, const L* a, const L* b, I k) {
+    I j = 0;
+
+#if defined(__AVX__)
+    for (; j + 4 <= k; j += 4)
+        _mm256_storeu_pd(
+          r + j, _mm256_add_pd(_mm256_loadu_pd(a + j), _mm256_loadu_pd(b + j)));
+#elif defined(__SSE2__)
+    for (; j + 2 <= k; j += 2)
+        _mm_storeu_pd(r + j,
+                      _mm_add_pd(_mm_loadu_pd(a + j), _mm_loadu_pd(b + j)));
+#endif
+
+    for (; j < k; j++)
+        r[j] = a[j] + b[j];
+}
+
+/**
+ * @brief Store the products of the `k` numbers at `a` and `b` in `r`
+ * @param[out] r Result, can be the same as `a` or `b`
+ * @param[in] a Numbers
+ * @param[in] b Numbers
+ * @param[in] k Number of elements of each one
+ */
+static void simd_mul(L* r, const L* a, const L* b, I k) {
+    I j = 0;
+
+#if defined(__AVX__)
+    for (; j + 4 <= k; j += 4)
+        _mm256_storeu_pd(
+          r + j, _mm256_mul_pd(_mm256_loadu_pd(a + j), _mm256_loadu_pd(b + j)));
+#elif defined(__SSE2__)
+    for (; j + 2 <= k; j += 2)
+        _mm_storeu_pd(r + j,
+                      _mm_mul_pd(_mm_loadu_pd(a + j), _mm_loadu_pd(b + j)));
+#endif
+
+    for (; j < k; j++)
+        r[j] = a[j] * b[j];
+}
+
+/**
+ * @brief Store the `k` numbers at `a` multiplied by `n` in `r`
+ * @param[out] r Result, can be the same as `a`
+ * @param[in] a Numbers
+ * @param[in] n Factor
+ * @param[in] k Number of elements
+ */
+static void simd_scale(L* r, const L* a, L n, I k) {
+    I j = 0;
+
+#if defined(__AVX__)
+    const __m256d f = _mm256_set1_pd(n);
+    for (; j + 4 <= k; j += 4)
+        _mm256_storeu_pd(r + j, _mm256_mul_pd(_mm256_loadu_pd(a + j), f));
+#elif defined(__SSE2__)
+    const __m128d f = _mm_set1_pd(n);
+    for (; j + 2 <= k; j += 2)
+        _mm_storeu_pd(r + j, _mm_mul_pd(_mm_loadu_pd(a + j), f));
+#endif
+
+    for (; j < k; j++)
+        r[j] = a[j] * n;
+}
+
+#endif    // SIMD_H_
@@ -9,10 +9,19 @@
  * @todo Add comment support (; to eol)
  */
 
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sysinfo.h>
+#include <time.h>
 
 /**
  * @def VERBOSE_ERRORS
@@ -20,8 +29,18 @@
  */
 #define VERBOSE_ERRORS
 
+/* Some functions are only used by main(), which is not in the library */
+#ifdef TINYLISP_LIBRARY
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+
+#include "libtinylisp.h" /* Interface of the library */
 #include "tinylisp.h" /* Typedefs, macros, globals, function prototypes */
+#include "simd.h" /* Vectorized kernels over arrays of numbers */
 #include "lisp_primitives.h" /* Lisp primitives, table of primitives */
+#include "bytecode.h" /* Bytecode compiler and virtual machine */
+#include "grisu.h" /* Shortest formatting of numbers */
+#include "net.h" /* Sockets of the server */
 
 /*-------------------------------- NaN BOXING --------------------------------*/
 
@@ -76,414 +95,4662 @@ static I equ(L x, L y) {
     return *(uint64_t*)&x == *(uint64_t*)&y;
 }
 
-/*-------------------------------- TODO --------------------------------*/
-
+#ifdef COMPACT
 /**
- * @brief Get heap index corresponding to the atom name, or allocate new
- * atom-tagged float
- * @details Checks if the atom name already exists on the heap (by iterating
- * until the heap pointer) and returns the index of the corresponding boxed
- * atom.
- *
- * If the atom name is new, then additional heap space is allocated to copy the
- * atom name into the heap as a string.
- * @param[in] s Atom name (Lisp symbols)
- * @return Corresponding NaN-boxed ATOM
+ * @brief Convert the expression `x` to a compact cell, see CELL_SHIFT
+ * @details Numbers and boxes that don't fit are appended to `wide`, which is
+ * never collected here, so storing an expression never moves the cells. They
+ * are only the same expression as long as their bits are, so equ() still works
+ * after unpacking them.
+ * @param[in] x NaN-boxed expression
+ * @return Compact cell
  */
-static L atom(const char* s) {
-    I i = 0;
+static C pack(L x) {
+    const uint64_t bits = *(uint64_t*)&x;
+    const I t           = bits >> 48;
 
-    /* Search for a matching atom name on the heap.
-     * Compares the string parameter with each element in the heap. We check
-     * until hp (heap pointer) for already existing atoms. If we reach hp, we
-     * allocate a new one. */
-    while (i < hp) {
-        /* cell[i] */
-        char* cur_str = HEAP_BOTTOM + i;
+    const I fits = (bits & (0xFFFFFFFFFFFFull & ~((1ull << CELL_BITS) - 1))) == 0;
 
-        /* Found string */
-        if (strcmp(cur_str, s) == 0)
-            break;
+    if ((t & 0x7ff8) == 0x7ff8 && fits)
+        return (C)bits << CELL_SHIFT | ((t & 7) | (t >> 12 & 8)) << 1;
 
-        /* Skip length of string we just checked + NULL terminator */
-        i += strlen(cur_str) + 1;
-    }
+    /* Integers, except -0, which has the sign bit set */
+    if (x >= -0x40000000 && x < 0x40000000 && x == (int32_t)x &&
+        bits != 1ull << 63)
+        return (uint32_t)(int32_t)x << 1 | 1;
 
-    /* If not found allocate and add a new atom name to the heap. Otherwise, if
-     * (i != hp), it means we found the atom, so we can skip this part and
-     * return it */
-    if (i == hp) {
-        /* Copy the new atom name to the heap */
-        strcpy(HEAP_BOTTOM + i, s);
+    if (t == 0 && fits)
+        return (C)bits << CELL_SHIFT | CELL_TAGS << 1;
 
-        /* Increase the heap pointer by the length of the new string + NULL */
-        hp += strlen(HEAP_BOTTOM + i) + 1;
+    if (wide_len == wide_size) {
+        if (wide_size >= 1u << CELL_BITS) {
+            fprintf(stderr, "Too many wide values for the compact cells.\n");
+            abort();
+        }
 
-        /* Abort when out of memory */
-        if (hp > sp * sizeof(L)) {
-            fprintf(stderr, "Ran out of heap space.\n");
+        wide_size = wide_size ? wide_size * 2 : WIDE_MIN;
+        wide      = realloc(wide, wide_size * sizeof(L));
+        if (wide == NULL) {
+            fprintf(stderr, "Couldn't allocate the wide values.\n");
             abort();
         }
     }
 
-    return box(ATOM, i);
+    wide[wide_len] = x;
+    return wide_len++ << CELL_SHIFT | CELL_WIDE << 1;
 }
 
-/* construct pair (x . y) returns a NaN-boxed CONS */
-static L cons(L x, L y) {
-    cell[--sp] = x;   /* push the car value x */
-    cell[--sp] = y;   /* push the cdr value y */
-    if (hp > sp << 3) /* abort when out of memory */
-        abort();
-    return box(CONS, sp);
-}
+/**
+ * @brief Convert the compact cell `c` back to an expression, see pack()
+ * @param[in] w Wide values of the interpreter that owns the cell
+ * @param[in] c Compact cell
+ * @return NaN-boxed expression
+ */
+static L unpack_in(const L* w, C c) {
+    const I k = c >> 1 & 0x1F;
 
-/* return the car of a pair or ERR if not a pair */
-static L car(L p) {
-    if ((T(p) & ~(CONS ^ CLOS)) == CONS)
-        return cell[ord(p) + 1];
-    else
-        err_msg("not a pair");
-}
+    if (c & 1)
+        return (int32_t)c >> 1;
+    if (k < CELL_TAGS)
+        return box(0x7ff8 | (k & 7) | (k & 8) << 12, c >> CELL_SHIFT);
+    if (k == CELL_TAGS)
+        return box(0, c >> CELL_SHIFT);
 
-/* return the cdr of a pair or ERR if not a pair */
-static L cdr(L p) {
-    if ((T(p) & ~(CONS ^ CLOS)) == CONS)
-        return cell[ord(p)];
-    else
-        err_msg("not a pair");
+    return w[c >> CELL_SHIFT];
 }
 
-/* construct a pair to add to environment e, returns the list ((v . x) . e) */
-static L pair(L v, L x, L e) {
-    return cons(cons(v, x), e);
+/* convert the compact cell c of this thread back to an expression */
+static L unpack(C c) {
+    return unpack_in(wide, c);
 }
+#endif
 
-/* construct a closure, returns a NaN-boxed CLOS */
-static L closure(L v, L x, L e) {
-    return box(CLOS, ord(pair(v, x, equ(e, env) ? nil : e)));
-}
+/*--------------------------------- GARBAGE ----------------------------------*/
 
-/* look up a symbol in an environment, return its value or ERR if not found */
-static L assoc(L v, L e) {
-    while (T(e) == CONS && !equ(v, car(car(e))))
-        e = cdr(e);
+/**
+ * @brief Register the address of a C variable as a garbage collector root
+ * @details Used by PROTECT()
+ * @param[in] x Address of the variable holding a Lisp expression
+ */
+static void protect(L* x) {
+    if (rp == roots_size) {
+        roots_size = roots_size ? roots_size * 2 : 256;
+        roots      = realloc(roots, roots_size * sizeof(L*));
+        if (roots == NULL) {
+            fprintf(stderr, "Couldn't allocate the garbage collector roots.\n");
+            abort();
+        }
+    }
 
-    if (T(e) == CONS)
-        return cdr(car(e));
-    else
-        err_msg("symbol %s not found", HEAP_BOTTOM + ord(v));
+    roots[rp++] = x;
 }
 
 /**
- * @brief Check if the argument is an empty list (`nil`)
- * @details Keep in mind that empty lists in Lisp are considered *false* and any
- * other values are considered *true*
+ * @brief Check if `x` is a pair (CONS or CLOS)
  * @param[in] x Expression to check
- * @return Non-zero if NILL, zero if non-nil
+ * @return Non-zero if `x` is a pair
  */
-static I not(L x) {
-    return T(x) == NIL;
-}
-
-/* let(x) is nonzero if x is a Lisp let/let* pair */
-static I let(L x) {
-    return T(x) != NIL && !not(cdr(x));
-}
-
-/* return a new list of evaluated Lisp expressions t in environment e */
-static L evlis(L t, L e) {
-    if (T(t) == CONS)
-        return cons(eval(car(t), e), evlis(cdr(t), e));
-    else if (T(t) == ATOM)
-        return assoc(t, e);
-    else
-        return nil;
+static I is_pair(L x) {
+    return (T(x) & ~(CONS ^ CLOS)) == CONS;
 }
 
-/*------------------------------- ENVIROMENTS --------------------------------*/
-
 /**
- * @brief Create environment by extending `e` with variables `v` bound to values
- * `t`
- * @details Description
- * @param[in] v Variables for the enviroment
- * @param[in] t List of values for the variables
- * @param[in] e Enviroment
- * @return Enviroment with `t` binded to `v`
+ * @brief Check if `x` is a block of cells, see block()
+ * @param[in] x Expression to check
+ * @return Non-zero if `x` is a block
  */
-static L bind(L v, L t, L e) {
-    if (T(v) == NIL)
-        return e;
-    else if (T(v) == CONS)
-        return bind(cdr(v), cdr(t), pair(car(v), car(t), e));
-    else
-        return pair(v, t, e);
+static I is_block(L x) {
+    return T(x) == VEC || T(x) == ARR || T(x) == HASH || T(x) == FRAME ||
+           T(x) == CODE || is_future(x);
 }
 
 /**
- * @brief Apply closure `f` to arguments `t` in environemt `e`
- * @details Called by apply() if the expression is a primitive
- * @param[in] f Closure to apply
- * @param[in] t List of arguments for closure `f`
- * @param[in] e Enviroment
- * @return Applied closure
+ * @brief Check if `x` is a future, see spawn()
+ * @details Negative NaN numbers have the same tag, but a zero ordinal.
+ * @param[in] x Expression to check
+ * @return Non-zero if `x` is a future
  */
-static L reduce(L f, L t, L e) {
-    return eval(cdr(car(f)),
-                bind(car(car(f)), evlis(t, e), not(cdr(f)) ? env : cdr(f)));
+static I is_future(L x) {
+    return T(x) == FUT && ord(x) != 0;
 }
 
 /**
- * @brief Apply closure or primitive `f` to arguments `t` in environment `e`
- * @details Will call reduce() if closure
- * @param[in] f Clousure or primitive
- * @param[in] t List of arguments
- * @param[in] e Enviroment
- * @return Applied expression if closure or primitive, `err` otherwise
+ * @brief Check if `x` is a pair or block allocated since the last collection
+ * @param[in] x Expression to check
+ * @return Non-zero if `x` is in the young generation
  */
-static L apply(L f, L t, L e) {
-    if (T(f) == PRIM)
-        return prim[ord(f)].f(t, e);
-    else if (T(f) == CLOS)
-        return reduce(f, t, e);
-    else
-        err_msg("not a valid clousure or primitive");
+static I young(L x) {
+    return (is_pair(x) || is_block(x)) && N - ord(x) < old_sp;
 }
 
 /**
- * @brief Evaluate `x` and return its value in environment `e`
- * @param[in] x Expression to evaluate
- * @param[in] e Enviroment of the expression
- * @return Evaluated expression
+ * @brief Copy a pair or block from the old cell space (spare[]) to the new one
+ * (cell[])
+ * @details Only young pairs and blocks are copied, the rest are returned as-is.
+ * The car of the old pair (or the header of the old block) is overwritten with a
+ * FWD box containing the new ordinal, so other references to the same cells are
+ * moved to the same copy.
+ * @param[in] x Expression to move
+ * @return The moved expression
  */
-static L eval(L x, L e) {
-    if (T(x) == ATOM)
-        return assoc(x, e);
-    else if (T(x) == CONS)
-        return apply(eval(car(x), e), cdr(x), e);
-    else
+static L move(L x) {
+    if (!young(x))
         return x;
-}
 
-/*--------------------------------- PARSING ----------------------------------*/
+    C* old = spare + N - ord(x);
 
-/**
- * @var buf
- * @brief Tokenization buffer
- */
-static char buf[40];
+    if (is_block(x)) {
+        const L h = unpack(*old);
 
-/**
- * @var see
- * @brief The next character that we are looking at (last read by look())
- */
-static char see = ' ';
+        /* Already moved, the header contains the new ordinal */
+        if (T(h) == FWD)
+            return box(T(x), ord(h));
 
-/**
- * @brief Store the current character in `see` and advances to the next
- * character
- * @details Checks for EOF
- */
-static void look(void) {
-    int c = getchar();
-    see   = c;
-    if (c == EOF)
-        exit(0);
+        /* Copy the header and the elements bellow it, and clear the remembered
+         * flag of the copy */
+        const I k = ord(h) & BLOCK_SIZE;
+        const I n = T(h) == RAW ? ARRAY_CELLS(k) : k;
+        sp -= n + 1;
+        memcpy(cell + sp, old - n, (n + 1) * sizeof(C));
+#ifdef COMPACT
+        /* The numbers of an array may need to be aligned again, see elems() */
+        if (T(h) == RAW)
+            memcpy(ALIGNED(cell + sp), ALIGNED(old - n), k * sizeof(L));
+#endif
+        cell[sp + n] = pack(box(T(h), k));
+        *old         = pack(box(FWD, N - sp - n));
+
+        return box(T(x), N - sp - n);
+    }
+
+    /* Already moved, old[1] (the car) contains the new ordinal */
+    const L y = unpack(old[1]);
+    if (T(y) == FWD)
+        return box(T(x), ord(y));
+
+    cell[--sp] = old[1];
+    cell[--sp] = old[0];
+    old[1]     = pack(box(FWD, N - sp));
+
+    return box(T(x), N - sp);
 }
 
 /**
- * @brief Check if we are looking at character c
- * @details Character `' '` will be passed as parameter in case of *any*
- * whitespace
- * @param[in] c Character to check
- * @return Non-zero if we are seeing that character
+ * @brief Move the expression stored in the cell `c`, see move()
+ * @details In COMPACT mode, only the cells of pairs and blocks are unpacked,
+ * which are never wide, see pack().
+ * @param[in] c Cell
+ * @return Cell of the moved expression
  */
-static inline I seeing(char c) {
-    if (c == ' ')
-        return see > 0 && see <= c;
-    else
-        return see == c;
+static C move_cell(C c) {
+#ifdef COMPACT
+    if ((c & 1) || (c >> 1 & 0x1F) >= CELL_TAGS)
+        return c;
+
+    return pack(move(unpack(c)));
+#else
+    return move(c);
+#endif
 }
 
 /**
- * @brief Return the look ahead character from standard input, advances to the
- * next
- * @return Current look ahead character
+ * @brief Add `x` to the remembered set, see dirty
+ * @details Called when a young cell is stored in the global value of the atom
+ * `x`, or in an old pair or block `x`. Blocks are only added once, using the
+ * BLOCK_REMEMBERED flag of their header.
+ * @param[in] x Atom, pair or block referencing a young cell
  */
-static char get(void) {
-    char c = see;
-    look();
-    return c;
+static void remember(L x) {
+    if (is_block(x)) {
+        const I h = ord(CELL(ord(x)));
+        if (h & BLOCK_REMEMBERED)
+            return;
+
+        SET_CELL(ord(x), box(HDR, h | BLOCK_REMEMBERED));
+    }
+
+    if (dirty_len == dirty_size) {
+        dirty_size = dirty_size ? dirty_size * 2 : 64;
+        dirty      = realloc(dirty, dirty_size * sizeof(L));
+        if (dirty == NULL) {
+            fprintf(stderr, "Couldn't allocate the remembered set.\n");
+            abort();
+        }
+    }
+
+    dirty[dirty_len++] = x;
 }
 
 /**
- * @brief Tokenize input into buf[]
- * @return First character of buf[]
+ * @brief Move the young cells reachable from the roots to the new cell space
+ * @details Cheney's algorithm. The roots are moved below `old_sp`, then the
+ * moved cells are scanned from there, moving the cells they reference, until
+ * there is nothing left to scan. Old cells are never moved nor scanned, unless
+ * they are in the remembered set.
  */
-static char scan(void) {
-    I i = 0;
+static void collect(void) {
+    for (I i = 0; i < dirty_len; i++) {
+        L x = dirty[i];
 
-    while (seeing(' '))
-        look();
+        C* const c = cell + N - ord(x);
 
-    if (seeing('(') || seeing(')') || seeing('\'')) {
-        buf[i++] = get();
-    } else {
-        do {
-            buf[i++] = get();
-        } while (i < 39 && !seeing('(') && !seeing(')') && !seeing(' '));
+        if (T(x) == ATOM) {
+            GLOBAL_CELL(x) = move_cell(GLOBAL_CELL(x));
+        } else if (is_block(x)) {
+            const I k = ord(unpack(*c)) & BLOCK_SIZE;
+            *c        = pack(box(HDR, k));
+            for (I j = 0; j < k; j++)
+                (c - k)[j] = move_cell((c - k)[j]);
+        } else {
+            c[1] = move_cell(c[1]);
+            c[0] = move_cell(c[0]);
+        }
     }
+    dirty_len = 0;
 
-    buf[i] = 0;
-    return *buf;
+    for (I i = 0; i < rp; i++)
+        *roots[i] = move(*roots[i]);
+
+    for (I i = 0; i < ops_len; i++)
+        ops[i] = move(ops[i]);
+
+    for (I i = 0; i < vp; i++)
+        vm[i] = move(vm[i]);
+
+    /* Everything above the scan index has been moved, along with the cells it
+     * references. Each block is stored as the header at [i - 1] followed by
+     * its elements, and each pair is stored as the car at [i - 1], and the cdr
+     * at [i - 2]. The elements of arrays are numbers, and are not scanned. */
+    for (I i = old_sp; i > sp;) {
+        const L h = unpack(cell[i - 1]);
+
+        if (T(h) == HDR) {
+            const I k = ord(h);
+            for (I j = i - 1 - k; j < i - 1; j++)
+                cell[j] = move_cell(cell[j]);
+            i -= k + 1;
+        } else if (T(h) == RAW) {
+            i -= ARRAY_CELLS(ord(h)) + 1;
+        } else {
+            cell[i - 1] = move_cell(cell[i - 1]);
+            cell[i - 2] = move_cell(cell[i - 2]);
+            i -= 2;
+        }
+    }
+
+    /* The survivors are promoted to the old generation */
+    old_sp = sp;
+    epoch++;
 }
 
 /**
- * @brief Scan and parse an expression from standard input
- * @details Calls scan() and parse()
- * @return The Lisp expression read from standard input
+ * @brief Allocate the spare cell space, if needed
  */
-static L read(void) {
-    scan();
-    return parse();
+static void alloc_spare(void) {
+    if (spare != NULL)
+        return;
+
+    spare = malloc(N * sizeof(C));
+    if (spare == NULL) {
+        fprintf(stderr, "Couldn't allocate %u spare cells.\n", N);
+        abort();
+    }
 }
 
 /**
- * @brief Parse a Lisp list
- * @details Uses input buffer `buf`
- * @return Parsed Lisp list
+ * @brief Minor garbage collection
+ * @details Only collects the young generation, the cells allocated since the
+ * last collection. Old cells can only reference younger cells if they were
+ * modified after being promoted, which only happens with define(), put() and
+ * setcdr(), so the young cells that survive must be reachable from the roots or
+ * from the remembered set (see remember()). The young cells are copied to the
+ * spare cell space and moved back to the bottom of the old generation, so the
+ * cost depends on the size of the nursery, not on the size of the global
+ * environment.
  */
-static L list(void) {
-    L x;
-    if (scan() == ')')
-        return nil;
+static void minor(void) {
+    const uint64_t start = now();
 
-    if (!strcmp(buf, ".")) {
-        x = read();
-        scan();
-        return x;
-    }
+    alloc_spare();
+    memcpy(spare + sp, cell + sp, (old_sp - sp) * sizeof(C));
+    sp = old_sp;
+    collect();
 
-    x = parse();
-    return cons(x, list());
+    stats.minors++;
+    collected(now() - start);
 }
 
 /**
- * @brief Parse a Lisp expression quoted as `(quote x)`
- * @details Uses input buffer `buf`
- * @return Parsed quoted expression
+ * @brief Garbage collection
+ * @details Collects both generations. The atom heap is copied to the spare cell
+ * space, which becomes the new cell[], and all the cells reachable from the
+ * roots and from the global values of the atoms are moved there.
  */
-static L quote(void) {
-    return cons(atom("quote"), cons(read(), nil));
+static void gc(void) {
+    const uint64_t start = now();
+
+    alloc_spare();
+
+    /* Swap the cell spaces, and copy the atom heap to the new one */
+    C* old_cell = cell;
+    cell        = spare;
+    spare       = old_cell;
+    memcpy(cell, spare, hp);
+
+    /* Everything is young, and will be moved without remembering */
+    sp        = N;
+    old_sp    = N;
+    dirty_len = 0;
+
+    for (I j = 0; j < symtab_size; j++)
+        if (symtab[j] != 0)
+            GLOBAL_CELL(box(ATOM, symtab[j] - 1)) =
+              move_cell(GLOBAL_CELL(box(ATOM, symtab[j] - 1)));
+
+    collect();
+    collect_wide();
+
+    stats.majors++;
+    collected(now() - start);
 }
 
 /**
- * @brief Parse ab atomic Lisp expression
- * @details Uses input buffer `buf`. An atomic expression is a number or an atom
- * @return Parsed atomic Lisp expression
+ * @brief Remove the wide values that are not referenced anymore, see pack()
+ * @details Called by gc() after moving the live cells. The wide values of the
+ * global values and of the stack cells are copied to a new array, in the order
+ * they are found, and the cells are changed to their new indexes. The numbers
+ * of the arrays are skipped, since they are plain doubles. Does nothing unless
+ * COMPACT is defined.
  */
-static L atomic(void) {
-    L n;
-    I i;
+static void collect_wide(void) {
+#ifdef COMPACT
+    L* old = wide;
+    I n    = 0;
 
-    if (sscanf(buf, "%lg%n", &n, &i) > 0 && !buf[i])
-        return n;
-    else
-        return atom(buf);
+/* Copy the wide value of the cell c, if any, and change its index */
+#define KEEP(c)                                               \
+    if (((c) & 1) == 0 && ((c) >> 1 & 0x1F) == CELL_WIDE) {  \
+        wide[n] = old[(c) >> CELL_SHIFT];                     \
+        (c)     = n++ << CELL_SHIFT | CELL_WIDE << 1;         \
+    }
+
+    wide = malloc(wide_size * sizeof(L));
+    if (wide_size > 0 && wide == NULL) {
+        fprintf(stderr, "Couldn't allocate the wide values.\n");
+        abort();
+    }
+
+    for (I j = 0; j < symtab_size; j++)
+        if (symtab[j] != 0)
+            KEEP(GLOBAL_CELL(box(ATOM, symtab[j] - 1)));
+
+    /* Same layout as the cells scanned by collect() */
+    for (I i = N; i > sp;) {
+        const L h = unpack_in(old, cell[i - 1]);
+
+        if (T(h) == HDR) {
+            const I k = ord(h) & BLOCK_SIZE;
+            for (I j = i - 1 - k; j < i - 1; j++)
+                KEEP(cell[j]);
+            i -= k + 1;
+        } else if (T(h) == RAW) {
+            i -= ARRAY_CELLS(ord(h)) + 1;
+        } else {
+            KEEP(cell[i - 1]);
+            KEEP(cell[i - 2]);
+            i -= 2;
+        }
+    }
+
+#undef KEEP
+
+    free(old);
+    wide_len   = n;
+    wide_limit = 2 * n > WIDE_MIN ? 2 * n : WIDE_MIN;
+#endif
 }
 
 /**
- * @brief Parse a Lisp expression
- * @details Uses input buffer `buf`
- * @return Parsed Lisp expression
+ * @brief Update the statistics after a collection
+ * @param[in] ns Duration of the collection, in nanoseconds
  */
-static L parse(void) {
-    if (*buf == '(')
-        return list();
-    else if (*buf == '\'')
-        return quote();
-    else
-        return atomic();
+static void collected(uint64_t ns) {
+    stats.gc_ns += ns;
+    if (ns > stats.max_ns)
+        stats.max_ns = ns;
+
+    stats.live = N - sp;
+    if (stats.live > stats.max_live)
+        stats.max_live = stats.live;
 }
 
-/*--------------------------------- PRINTING ---------------------------------*/
+/*--------------------------------- MEMORY -----------------------------------*/
 
 /**
- * @brief Display a Lisp expression
- * @param[in] x Expression to print
+ * @brief Stop evaluating when the cell space is full and can't grow
+ * @details Returns from eval_source() in the library, see finish, so the
+ * interpreter can still be used. The cells are left as they were before the
+ * allocation, and the garbage collector roots of the evaluation are dropped.
+ * The workers of the pool stop the chunk or the task instead, see evaluate().
+ * Aborts in the REPL.
+ * @param[in] msg Message written to the standard error
  */
-static void print(L x) {
-    /* NOTE: We don't use switch here because type tags are not constant at
-     * compile time */
-    if (T(x) == NIL)
-        printf("()");
-    else if (T(x) == ATOM)
-        printf("%s", HEAP_BOTTOM + ord(x));
-    else if (T(x) == PRIM)
-        printf("<%s>", prim[ord(x)].s);
-    else if (T(x) == CONS)
-        printlist(x);
-    else if (T(x) == CLOS)
-        printf("{%u}", ord(x));
-    else
-        printf("%.10lg", x);
+static _Noreturn void out_of_memory(const char* msg) {
+    fputs(msg, stderr);
+
+    if (finish != NULL)
+        longjmp(*finish, EVAL_MEMORY);
+
+    abort();
 }
 
 /**
- * @brief Display a Lisp list
- * @param[in] t List to be printed
+ * @brief Move the cell space to a region twice as big
+ * @details The atom heap stays at the bottom, and the stack is moved to the top
+ * of the new region. Since stack ordinals are relative to the top of cell[]
+ * (see CELL), the boxed CONS and CLOS expressions are still valid afterwards.
  */
-static void printlist(L t) {
-    for (putchar('(');; putchar(' ')) {
-        print(car(t));
-        t = cdr(t);
+static void grow(void) {
+    I n = N * 2;
 
-        if (T(t) == NIL)
-            break;
+    /* Ordinals are 32 bit, we can't address more cells than that */
+    if (n <= N || n > MAX_CELLS)
+        out_of_memory("Can't grow the cell space any further.\n");
 
-        if (T(t) != CONS) {
-            printf(" . ");
-            print(t);
-            break;
-        }
-    }
-    putchar(')');
+    /* Large blocks are remapped by realloc(), instead of copied */
+    C* new_cell = realloc(cell, n * sizeof(C));
+    if (new_cell == NULL)
+        out_of_memory("Couldn't grow the cell space.\n");
+
+    /* Move the stack to the top of the new region */
+    memmove(new_cell + sp + (n - N), new_cell + sp, (N - sp) * sizeof(C));
+
+    cell = new_cell;
+    sp += n - N;
+    old_sp += n - N;
+    N = n;
+    stats.grows++;
+
+    nursery = N / 4 < NURSERY_CELLS ? N / 4 : NURSERY_CELLS;
+
+    /* The spare cells need to be as big as cell[], gc() will allocate them */
+    free(spare);
+    spare = NULL;
 }
 
-/*--------------------------------- GARBAGE ----------------------------------*/
+/**
+ * @brief Make sure the atom heap and the stack don't collide after allocating
+ * `bytes` more bytes on either of them
+ * @details Called when the nursery is full, or when the free space runs out.
+ * The young generation is collected first. If there is no space left for a
+ * whole nursery, both generations are collected, and if there is still not
+ * enough space the cell space grows if enabled, or runs out of memory, see
+ * out_of_memory(). When
+ * growing is enabled, the cell space will also grow if less than a quarter of
+ * it is free after the collection, to avoid collecting too often.
+ *
+ * The workers of the pool never collect both generations, and grow instead, so
+ * the cells they copied from the caller keep their ordinals, see shared().
+ * @param[in] bytes Number of bytes that are going to be allocated
+ */
+static void reserve(uint64_t bytes) {
+    minor();
+
+    if (hp + bytes + nursery * sizeof(C) <= sp * sizeof(C) && !WIDE_FULL)
+        return;
+
+    if (!worker)
+        gc();
+
+#ifdef COMPACT
+    /* The wide values of the workers are never collected */
+    if (wide_len >= wide_limit)
+        wide_limit = 2 * wide_len;
+#endif
+
+    while (hp + bytes > sp * sizeof(C) ||
+           (growable && sp - hp / sizeof(C) < N / 4)) {
+        if (!growable)
+            out_of_memory("Ran out of memory.\n");
+
+        grow();
+    }
+}
 
 /**
- * @brief Garbage collection
- * @details Removes temporary cells, keeps global environment
+ * @brief Check if a block of `k` cells could be allocated, see block()
+ * @details The stack and the atom heap share the cell space, which can only
+ * grow up to MAX_CELLS if growing is enabled. Used by the primitives to reject
+ * sizes that would never fit, instead of running out of memory.
+ * @param[in] k Number of cells bellow the header
+ * @return Non-zero if the block fits in the cell space
  */
-static void gc(void) {
-    sp = ord(env);
+static I fits(uint64_t k) {
+    const uint64_t cells = growable ? MAX_CELLS : N;
+
+    return k + 1 <= cells - hp / sizeof(C);
 }
 
-/*----------------------------------- MAIN -----------------------------------*/
+/*---------------------------------- ATOMS -----------------------------------*/
 
 /**
- * @brief Entry point of the REPL
- * @details We initialize the predefined atoms (`nil`, `err` and `tru`) and the
- * enviroment (`env`). We add the primitives to the enviroment and start the
- * main loop.
- * @return Exit code
+ * @def SYMTAB_MIN
+ * @brief Initial number of slots in the symbol table
  */
-int main(void) {
-    printf("--- TinyLisp REPL ---");
+#define SYMTAB_MIN 64
 
-    nil = box(NIL, 0);
-    err = atom("ERR");
-    tru = atom("t");
-    env = pair(tru, tru, nil);
+/**
+ * @brief Hash an atom name for the symbol table
+ * @details 32 bit FNV-1a
+ * @param[in] s Atom name
+ * @return Hash of the string
+ */
+static I strhash(const char* s) {
+    I h = 2166136261u;
 
-    for (I i = 0; prim[i].s != NULL; i++)
-        env = pair(atom(prim[i].s), box(PRIM, i), env);
+    while (*s != '\0') {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
 
-    while (1) {
-        printf("\n[%u]> ", sp - hp / 8);
-        print(eval(read(), env));
-        gc();
+    return h;
+}
+
+/**
+ * @brief Resize the symbol table to `size` slots and reinsert the atoms
+ * @details The atom names are already on the heap, so we only need to rehash
+ * them into the new table.
+ * @param[in] size New number of slots, must be a power of two
+ */
+static void rehash(I size) {
+    I* old     = symtab;
+    I old_size = symtab_size;
+
+    symtab = calloc(size, sizeof(I));
+    if (symtab == NULL) {
+        fprintf(stderr, "Couldn't allocate the symbol table.\n");
+        abort();
+    }
+    symtab_size = size;
+
+    for (I j = 0; j < old_size; j++) {
+        if (old[j] == 0)
+            continue;
+
+        I k = strhash(HEAP_BOTTOM + old[j] - 1) & (size - 1);
+        while (symtab[k] != 0)
+            k = (k + 1) & (size - 1);
+
+        symtab[k] = old[j];
+    }
+
+    free(old);
+}
+
+/**
+ * @brief Get heap index corresponding to the atom name, or allocate new
+ * atom-tagged float
+ * @details Looks up the atom name in the symbol table (linear probing from the
+ * hash of the name) and returns the index of the corresponding boxed atom.
+ *
+ * If the atom name is new, then additional heap space is allocated to copy the
+ * atom name into the heap as a string, and its heap index is added to the
+ * symbol table. The name is preceded by a cell with its global value (see
+ * GLOBAL), initially `err`, and padded so the next cell stays aligned.
+ * @param[in] s Atom name (Lisp symbols)
+ * @return Corresponding NaN-boxed ATOM
+ */
+static L atom(const char* s) {
+    I i, j;
+
+    if (symtab_size == 0)
+        rehash(SYMTAB_MIN);
+
+    /* Search for a matching atom name in the symbol table. We stop at the first
+     * empty slot, which is where the new atom will be stored. */
+    for (j = strhash(s) & (symtab_size - 1); symtab[j] != 0;
+         j = (j + 1) & (symtab_size - 1)) {
+        i = symtab[j] - 1;
+
+        /* Found string */
+        if (strcmp(HEAP_BOTTOM + i, s) == 0)
+            return box(ATOM, i);
+    }
+
+    /* Not found, allocate and add a new atom name to the heap */
+    const I len  = strlen(s) + 1;
+    const I size = sizeof(C) + (len + sizeof(C) - 1) / sizeof(C) * sizeof(C);
+
+    /* Collect garbage, grow or abort when out of memory */
+    if (hp + size > sp * sizeof(C))
+        reserve(size);
+
+    /* Copy the new atom name to the heap, after its global value */
+    i = hp + sizeof(C);
+    memcpy(HEAP_BOTTOM + i, s, len);
+    GLOBAL_CELL(box(ATOM, i)) = pack(err);
+
+    /* Increase the heap pointer by the size of the value and the string */
+    hp += size;
+
+    /* Store the heap index in the empty slot we found, and keep the table at
+     * most half full */
+    symtab[j] = i + 1;
+    if (++symtab_used * 2 > symtab_size)
+        rehash(symtab_size * 2);
+
+    return box(ATOM, i);
+}
+
+/**
+ * @brief Bind the atom `v` to `x` in the global environment
+ * @details If `x` is young, the atom is remembered so the next minor collection
+ * moves its value.
+ * @param[in] v Atom to define
+ * @param[in] x New global value
+ */
+static void define(L v, L x) {
+    GLOBAL_CELL(v) = pack(x);
+
+    if (young(x))
+        remember(v);
+}
+
+/*---------------------------------- PAIRS -----------------------------------*/
+
+/* construct pair (x . y) returns a NaN-boxed CONS */
+static L cons(L x, L y) {
+    if (old_sp - sp >= nursery || hp + 2 * sizeof(C) > sp * sizeof(C) ||
+        WIDE_FULL) {
+        /* collect garbage, grow or abort when out of memory or when the nursery
+         * is full */
+        PROTECT(x);
+        PROTECT(y);
+        reserve(2 * sizeof(C));
+        UNPROTECT(2);
+    }
+
+    stats.conses++;
+    if (profiling)
+        profile[profile_current].conses++;
+
+    cell[--sp] = pack(x);   /* push the car value x */
+    cell[--sp] = pack(y);   /* push the cdr value y */
+    return box(CONS, N - sp);
+}
+
+/* return the car of a pair or ERR if not a pair */
+static L car(L p) {
+    if ((T(p) & ~(CONS ^ CLOS)) == CONS)
+        return CELL(ord(p) - 1);
+    else
+        err_msg("not a pair");
+}
+
+/* return the cdr of a pair or ERR if not a pair */
+static L cdr(L p) {
+    if ((T(p) & ~(CONS ^ CLOS)) == CONS)
+        return CELL(ord(p));
+    else
+        err_msg("not a pair");
+}
+
+/**
+ * @brief Replace the cdr of the pair `p` with `x`
+ * @details Only used to append to lists while they are being built, e.g. in
+ * evlis(). The pair might have been promoted by a collection since it was
+ * allocated, so it's remembered if needed, like in put().
+ * @param[in] p Last pair of a list
+ * @param[in] x New cdr
+ */
+static void setcdr(L p, L x) {
+    SET_CELL(ord(p), x);
+
+    if (young(x) && !young(p))
+        remember(p);
+}
+
+/* construct a pair to add to environment e, returns the list ((v . x) . e) */
+static L pair(L v, L x, L e) {
+    PROTECT(e);
+    x = cons(v, x);
+    UNPROTECT(1);
+    return cons(x, e);
+}
+
+/* construct a closure, returns a NaN-boxed CLOS */
+static L closure(L v, L x, L e) {
+    return box(CLOS, ord(pair(v, x, e)));
+}
+
+/*---------------------------------- BLOCKS ----------------------------------*/
+
+/**
+ * @brief Allocate a block of `k` contiguous cells initialized to `x`
+ * @details Blocks are stored on the stack as a header cell (a HDR box with the
+ * number of elements) followed by the elements bellow it. The returned
+ * expression is tagged with `t`, and its ordinal is the one of the header, so
+ * the elements can be accessed with ELEM().
+ * @param[in] t Tag of the returned expression, e.g. VEC or FRAME
+ * @param[in] k Number of elements
+ * @param[in] x Initial value of the elements
+ * @return NaN-boxed block
+ */
+static L block(I t, I k, L x) {
+    const uint64_t bytes = ((uint64_t)k + 1) * sizeof(C);
+
+    if (old_sp - sp >= nursery || hp + bytes > sp * sizeof(C) || WIDE_FULL) {
+        PROTECT(x);
+        reserve(bytes);
+        UNPROTECT(1);
+    }
+
+    stats.blocks++;
+    sp -= k + 1;
+    cell[sp + k] = pack(box(HDR, k));
+
+    const C c = pack(x);
+    for (I j = 0; j < k; j++)
+        cell[sp + j] = c;
+
+    return box(t, N - sp - k);
+}
+
+/**
+ * @brief Allocate an array of `k` numbers initialized to `n`
+ * @details Arrays are blocks with a RAW header instead of a HDR one, so the
+ * garbage collector copies them without looking at the elements: they are
+ * plain doubles, and a NaN element must not be mistaken for a boxed pair.
+ * @param[in] k Number of elements
+ * @param[in] n Initial value of the elements
+ * @return NaN-boxed ARR block
+ */
+static L array(I k, L n) {
+#ifdef COMPACT
+    const L a = block(ARR, ARRAY_CELLS(k), 0);
+    SET_CELL(ord(a), box(RAW, k));
+    for (I j = 0; j < k; j++)
+        elems(a)[j] = n;
+#else
+    const L a = block(ARR, k, n);
+    SET_CELL(ord(a), box(RAW, k));
+#endif
+    return a;
+}
+
+/* return the number of elements of a block */
+static I size(L b) {
+    return ord(CELL(ord(b))) & BLOCK_SIZE;
+}
+
+/**
+ * @brief Address of the numbers of the array `b` in memory
+ * @details The numbers are stored bellow the header, so the returned address
+ * is the one of the last number, and AREF(b, j) is at
+ * `elems(b)[size(b) - 1 - j]`. Numeric kernels that don't care about the
+ * order can use the numbers as a contiguous C array. The address is only valid
+ * until the next allocation.
+ *
+ * In COMPACT mode, each number takes two cells, and the array has one more
+ * cell, so the numbers can start at an aligned address. Since N is even, the
+ * alignment of a cell only depends on its ordinal.
+ * @param[in] b Array
+ * @return Pointer to the lowest number
+ */
+static L* elems(L b) {
+    return ALIGNED(&cell[N - ord(b) - ARRAY_CELLS(size(b))]);
+}
+
+/**
+ * @brief Store `x` as element `j` of the block `b`
+ * @details Blocks can be old when they are modified, so this function
+ * remembers them if needed. See remember().
+ * @param[in] b Block to modify
+ * @param[in] j Index of the element
+ * @param[in] x New value of the element
+ */
+static void put(L b, I j, L x) {
+    SET_ELEM(b, j, x);
+
+    if (young(x) && !young(b))
+        remember(b);
+}
+
+/*------------------------------- HASH TABLES --------------------------------*/
+
+/**
+ * @def HASH_MIN
+ * @brief Initial number of slots of a hash table
+ */
+#define HASH_MIN 8
+
+/**
+ * @brief Hash of the bits of `x`, see equ()
+ * @details Finalizer of MurmurHash3, so that numbers and ordinals that only
+ * differ in their low bits are spread over the table.
+ * @param[in] x Key
+ * @return Hash of the key
+ */
+static I keyhash(L x) {
+    uint64_t h = *(uint64_t*)&x;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+
+    return (I)h;
+}
+
+/**
+ * @brief Allocate an empty hash table
+ * @details Hash tables are blocks tagged HASH, whose elements are described in
+ * HASH_COUNT. The keys and values are stored in consecutive elements of the
+ * HASH_SLOTS vector, with open addressing and linear probing. Empty slots have
+ * a HDR box as their key, which can't be a Lisp value.
+ * @return NaN-boxed HASH block
+ */
+static L table(void) {
+    L h = block(HASH, HASH_SLOTS + 1, box(0, 0)), s;
+
+    PROTECT(h);
+    s = block(VEC, 2 * HASH_MIN, box(HDR, 0));
+    UNPROTECT(1);
+
+    put(h, HASH_SLOTS, s);
+    SET_ELEM(h, HASH_EPOCH, box(0, epoch));
+    return h;
+}
+
+/**
+ * @brief Slot of the key `x` in the hash table `h`
+ * @details The table must be up to date, see refresh(). Tables are never full,
+ * so the search always ends.
+ * @param[in] h Hash table
+ * @param[in] x Key
+ * @return Index of the slot with the key, or of the empty slot where it should
+ * be inserted
+ */
+static I lookup(L h, L x) {
+    const L s    = ELEM(h, HASH_SLOTS);
+    const I mask = size(s) / 2 - 1;
+    L y;
+
+    for (I j = keyhash(x) & mask;; j = (j + 1) & mask) {
+        y = ELEM(s, 2 * j);
+        if (T(y) == HDR || equ(y, x))
+            return j;
+    }
+}
+
+/**
+ * @brief Move the keys and values of the hash table `h` to `cap` new slots
+ * @details The keys are hashed again, so this is also used by refresh().
+ * @param[in] h Hash table
+ * @param[in] cap New number of slots, a power of two
+ */
+static void resize(L h, I cap) {
+    L s, old, y;
+    I i;
+
+    PROTECT(h);
+    s = block(VEC, 2 * cap, box(HDR, 0));
+    UNPROTECT(1);
+
+    old = ELEM(h, HASH_SLOTS);
+    put(h, HASH_SLOTS, s);
+
+    /* The slots are new, so they can be set without put() */
+    for (I j = 0; j < size(old); j += 2) {
+        y = ELEM(old, j);
+        if (T(y) == HDR)
+            continue;
+
+        i                  = lookup(h, y);
+        SET_ELEM(s, 2 * i, y);
+        SET_ELEM(s, 2 * i + 1, ELEM(old, j + 1));
+    }
+
+    /* Nothing was allocated since the new slots */
+    SET_ELEM(h, HASH_EPOCH, box(0, epoch));
+}
+
+/**
+ * @brief Hash the keys of the table `h` again if some of them were moved
+ * @details Pairs and blocks are hashed by their ordinals, which change when
+ * they are moved by the garbage collector. Atoms, numbers and the other keys
+ * never change.
+ * @param[in] h Hash table
+ */
+static void refresh(L h) {
+    if (ord(ELEM(h, HASH_MOVABLE)) > 0 && ord(ELEM(h, HASH_EPOCH)) != epoch)
+        resize(h, size(ELEM(h, HASH_SLOTS)) / 2);
+}
+
+/**
+ * @brief Value of the key `x` in the hash table `h`
+ * @param[in] h Hash table
+ * @param[in] x Key
+ * @param[in] d Value returned if the key is not in the table
+ * @return Value of the key, or `d`
+ */
+static L hash_get(L h, L x, L d) {
+    L s, y;
+    I j;
+
+    PROTECT(h);
+    PROTECT(x);
+    PROTECT(d);
+    refresh(h);
+    UNPROTECT(3);
+
+    s = ELEM(h, HASH_SLOTS);
+    j = lookup(h, x);
+    y = ELEM(s, 2 * j);
+    if (T(y) == HDR)
+        return d;
+
+    return ELEM(s, 2 * j + 1);
+}
+
+/**
+ * @brief Set the value of the key `x` in the hash table `h` to `y`
+ * @details The table grows when three quarters of the slots are in use.
+ * @param[in] h Hash table
+ * @param[in] x Key
+ * @param[in] y Value
+ */
+static void hash_put(L h, L x, L y) {
+    const I count = ord(ELEM(h, HASH_COUNT));
+    L s, k;
+    I j;
+
+    PROTECT(h);
+    PROTECT(x);
+    PROTECT(y);
+    refresh(h);
+    if ((count + 1) * 4 > size(ELEM(h, HASH_SLOTS)) / 2 * 3)
+        resize(h, size(ELEM(h, HASH_SLOTS)));
+    UNPROTECT(3);
+
+    s = ELEM(h, HASH_SLOTS);
+    j = lookup(h, x);
+    k = ELEM(s, 2 * j);
+
+    if (T(k) == HDR) {
+        SET_ELEM(h, HASH_COUNT, box(0, count + 1));
+        if (is_pair(x) || is_block(x))
+            SET_ELEM(h, HASH_MOVABLE,
+                     box(0, ord(ELEM(h, HASH_MOVABLE)) + 1));
+
+        put(s, 2 * j, x);
+    }
+
+    put(s, 2 * j + 1, y);
+}
+
+/**
+ * @brief Remove the key `x` from the hash table `h`
+ * @details The following keys of the same run of slots are shifted back if
+ * their position is not reachable anymore from the slot of their hash, so no
+ * deleted marks are needed.
+ * @param[in] h Hash table
+ * @param[in] x Key
+ * @return Non-zero if the key was in the table
+ */
+static I hash_remove(L h, L x) {
+    L s, y;
+    I i, j, k, mask;
+
+    PROTECT(h);
+    PROTECT(x);
+    refresh(h);
+    UNPROTECT(2);
+
+    s    = ELEM(h, HASH_SLOTS);
+    mask = size(s) / 2 - 1;
+    i    = lookup(h, x);
+    y    = ELEM(s, 2 * i);
+
+    if (T(y) == HDR)
+        return 0;
+
+    SET_ELEM(h, HASH_COUNT, box(0, ord(ELEM(h, HASH_COUNT)) - 1));
+    if (is_pair(x) || is_block(x))
+        SET_ELEM(h, HASH_MOVABLE, box(0, ord(ELEM(h, HASH_MOVABLE)) - 1));
+
+    for (j = (i + 1) & mask; y = ELEM(s, 2 * j), T(y) != HDR;
+         j = (j + 1) & mask) {
+        /* Keep the key at j if its slot k is cyclically in (i, j] */
+        k = keyhash(y) & mask;
+        if (i <= j ? i < k && k <= j : i < k || k <= j)
+            continue;
+
+        put(s, 2 * i, y);
+        put(s, 2 * i + 1, ELEM(s, 2 * j + 1));
+        i = j;
+    }
+
+    SET_ELEM(s, 2 * i, box(HDR, 0));
+    SET_ELEM(s, 2 * i + 1, box(HDR, 0));
+    return 1;
+}
+
+/*------------------------------- ENVIROMENTS --------------------------------*/
+
+/**
+ * @brief Number of variables in a list of variables `v`
+ * @details The list can be proper `(a b)`, dotted `(a b . c)` or a single atom
+ * `c`, where `c` is bound to the list of remaining values.
+ * @param[in] v List of variables
+ * @return Number of variables
+ */
+static I slots(L v) {
+    I k = 0;
+
+    for (; T(v) == CONS; v = cdr(v))
+        k++;
+
+    return T(v) == NIL ? k : k + 1;
+}
+
+/**
+ * @brief Position of the atom `x` in the list of variables `v`
+ * @param[in] x Variable to look for
+ * @param[in] v List of variables, see slots()
+ * @return Index of the variable, or NOT_FOUND
+ */
+static I slot(L x, L v) {
+    I i = 0;
+
+    for (; T(v) == CONS; v = cdr(v), i++)
+        if (equ(x, car(v)))
+            return i;
+
+    return equ(x, v) ? i : NOT_FOUND;
+}
+
+/**
+ * @brief Construct an environment frame for the variables `v`, extending `e`
+ * @details Frames are blocks whose first element is the list of variables, the
+ * second one is the parent environment, and the rest are the values of the
+ * variables, initially `err`.
+ * @param[in] v List of variables, see slots()
+ * @param[in] e Parent enviroment
+ * @return NaN-boxed FRAME
+ */
+static L frame(L v, L e) {
+    L d;
+    PROTECT(v);
+    PROTECT(e);
+    d = block(FRAME, FRAME_VARS + slots(v), err);
+    UNPROTECT(2);
+    SET_ELEM(d, FRAME_NAMES, v);
+    SET_ELEM(d, FRAME_PARENT, e);
+    return d;
+}
+
+/* look up a symbol (an ATOM or a GREF) in the global environment. Return its
+ * value or ERR if not found */
+static L global(L v) {
+    if (!equ(GLOBAL(v), err))
+        return GLOBAL(v);
+    else
+        err_msg("symbol %s not found", HEAP_BOTTOM + ord(v));
+}
+
+/* look up a symbol in a local environment, and then in the global one. Return
+ * its value or ERR if not found */
+static L assoc(L v, L e) {
+    for (; T(e) == FRAME; e = ELEM(e, FRAME_PARENT)) {
+        const I i = slot(v, ELEM(e, FRAME_NAMES));
+        if (i != NOT_FOUND)
+            return ELEM(e, FRAME_VARS + i);
+    }
+
+    return global(v);
+}
+
+/**
+ * @brief Value of the local variable with lexical address `x` in the
+ * environment `e`
+ * @details See lref().
+ * @param[in] x NaN-boxed LREF
+ * @param[in] e Enviroment
+ * @return Value of the variable, or ERR if the address is not valid in `e`
+ */
+static L local(L x, L e) {
+    const uint64_t bits = *(uint64_t*)&x;
+    I depth = bits >> 40 & 0xFF, i = bits >> 32 & 0xFF;
+
+    for (; depth > 0 && T(e) == FRAME; depth--)
+        e = ELEM(e, FRAME_PARENT);
+
+    if (T(e) == FRAME && FRAME_VARS + i < size(e))
+        return ELEM(e, FRAME_VARS + i);
+    else
+        err_msg("invalid address for %s", HEAP_BOTTOM + ord(x));
+}
+
+/**
+ * @brief Check if the argument is an empty list (`nil`)
+ * @details Keep in mind that empty lists in Lisp are considered *false* and any
+ * other values are considered *true*
+ * @param[in] x Expression to check
+ * @return Non-zero if NILL, zero if non-nil
+ */
+static I not(L x) {
+    return T(x) == NIL;
+}
+
+/* let(x) is nonzero if x is a Lisp let/let* pair */
+static I let(L x) {
+    return T(x) != NIL && !not(cdr(x));
+}
+
+/**
+ * @brief Return a new list of evaluated Lisp expressions `t` in environment `e`
+ * @details The list is built from the front, appending each value to the last
+ * pair with setcdr(), so it doesn't recurse. A variable at the end of `t`, e.g.
+ * in `(f . args)`, is replaced by its value.
+ * @param[in] t List of expressions
+ * @param[in] e Environment of the expressions
+ * @return List of values
+ */
+static L evlis(L t, L e) {
+    L head = nil, last = nil, x;
+    PROTECT(t);
+    PROTECT(e);
+    PROTECT(head);
+    PROTECT(last);
+
+    for (; T(t) == CONS; t = cdr(t)) {
+        x = eval(car(t), e);
+        x = cons(x, nil);
+
+        if (T(last) == NIL)
+            head = x;
+        else
+            setcdr(last, x);
+
+        last = x;
+    }
+
+    if (T(t) == ATOM)
+        x = assoc(t, e);
+    else if (T(t) == LREF)
+        x = local(t, e);
+    else if (T(t) == GREF)
+        x = global(t);
+    else
+        x = nil;
+
+    if (T(last) == NIL)
+        head = x;
+    else
+        setcdr(last, x);
+
+    UNPROTECT(4);
+    return head;
+}
+
+/**
+ * @brief Create environment by extending `e` with variables `v` bound to values
+ * `t`
+ * @details Constructs a new frame, see frame().
+ * @param[in] v Variables for the enviroment, see slots()
+ * @param[in] t List of values for the variables
+ * @param[in] e Enviroment
+ * @return Enviroment with `t` binded to `v`
+ */
+static L bind(L v, L t, L e) {
+    L d;
+    I i = FRAME_VARS;
+    PROTECT(t);
+    d = frame(v, e);
+    UNPROTECT(1);
+
+    for (v = ELEM(d, FRAME_NAMES); T(v) == CONS; v = cdr(v), t = cdr(t))
+        SET_ELEM(d, i++, car(t));
+
+    if (T(v) != NIL)
+        SET_ELEM(d, i, t);
+
+    return d;
+}
+
+/**
+ * @brief Create the environment for applying closure `f` to arguments `t` in
+ * environment `e`
+ * @details The frame is constructed first, and each argument is evaluated in
+ * `e` and stored in it as soon as it is evaluated, without building a list of
+ * values first. The remaining arguments (e.g. for `(lambda args x)`, or when
+ * calling `(f . args)`) are evaluated with evlis() and bound like in bind().
+ *
+ * The closure body is not evaluated here, eval() does it in its loop.
+ * @param[in] f Closure to apply
+ * @param[in] t List of arguments for closure `f`
+ * @param[in] e Enviroment of the arguments
+ * @return Enviroment for the body of the closure
+ */
+static L reduce(L f, L t, L e) {
+    L d, v, x;
+    I i = FRAME_VARS;
+    PROTECT(t);
+    PROTECT(e);
+    d = frame(car(car(f)), cdr(f));
+    PROTECT(d);
+    v = ELEM(d, FRAME_NAMES);
+    PROTECT(v);
+
+    for (; T(v) == CONS && T(t) == CONS; v = cdr(v), t = cdr(t)) {
+        x = eval(car(t), e);
+        put(d, i++, x);
+    }
+
+    /* Bind the rest of the variables to the rest of the values */
+    x = evlis(t, e);
+    for (; T(v) == CONS; v = cdr(v), x = cdr(x))
+        put(d, i++, car(x));
+
+    if (T(v) != NIL)
+        put(d, i, x);
+
+    UNPROTECT(4);
+    return d;
+}
+
+/*---------------------------- LEXICAL ADDRESSING ----------------------------*/
+
+/**
+ * @brief Construct the lexical address of a local variable
+ * @details The address is a NaN-boxed LREF containing the number of parent
+ * frames to follow (`depth`), the index `i` of the variable in that frame, and
+ * the atom `v` as the ordinal, so it can still be printed. See local().
+ * @param[in] depth Number of frames between the reference and the variable
+ * @param[in] i Index of the variable in its frame
+ * @param[in] v Name of the variable
+ * @return NaN-boxed LREF
+ */
+static L lref(I depth, I i, L v) {
+    L x;
+    *(uint64_t*)&x = (uint64_t)LREF << 48 | (uint64_t)depth << 40 |
+                     (uint64_t)i << 32 | ord(v);
+    return x;
+}
+
+/**
+ * @brief Construct the reference to the global variable `v` at the head of a
+ * form recognized by resolve()
+ * @details The kind of form and the primitive `p` that `v` was bound to are
+ * stored above the ordinal, so eval() can dispatch the form directly while `v`
+ * is still bound to `p`. See FORM_CALL.
+ * @param[in] v Name of the variable
+ * @param[in] form Kind of form, FORM_CONST or a special form
+ * @param[in] p Primitive, with an ordinal up to 0xFF
+ * @return NaN-boxed GREF
+ */
+static L gref(L v, I form, L p) {
+    L x;
+    *(uint64_t*)&x = (uint64_t)GREF << 48 | (uint64_t)ord(p) << 40 |
+                     (uint64_t)form << 32 | ord(v);
+    return x;
+}
+
+/**
+ * @brief Kind of form of the GREF `x`, see gref()
+ * @param[in] x NaN-boxed GREF
+ * @return FORM_CALL, FORM_CONST or a special form
+ */
+static I gref_form(L x) {
+    return *(uint64_t*)&x >> 32 & 0xFF;
+}
+
+/**
+ * @brief Check if the call of the primitive `p` with the arguments `t` can be
+ * evaluated when it's resolved
+ * @details Only the arithmetic primitives are folded, and only if all the
+ * arguments are numbers and there are as many as they use.
+ * @param[in] p Primitive
+ * @param[in] t List of resolved arguments
+ * @return Non-zero if the call is constant
+ */
+static I foldable(L p, L t) {
+    const PrimPair* q = &prim[ord(p)];
+    I k = 0;
+
+    if (q->op != op_add && q->op != op_sub && q->op != op_mul &&
+        q->op != op_div && q->op != op_int && q->op != op_lt)
+        return 0;
+
+    /* Any tagged expression is a NaN, so `x == x` only holds for numbers */
+    for (; T(t) == CONS; t = cdr(t), k++)
+        if (car(t) != car(t))
+            return 0;
+
+    return T(t) == NIL && (q->n == VARIADIC ? k > 0 : k == q->n);
+}
+
+/**
+ * @brief Lexical address of the atom `v` in the scope `s`, followed by the
+ * environment `e`
+ * @details If the atom is not local, no frame of the environment where the
+ * scope is evaluated can bind it, so it's always found in the global
+ * environment. A GREF box is returned in that case, which eval() looks up with
+ * global() without searching the frames first. Since global values are stored
+ * in the atoms themselves (see GLOBAL), redefinitions are seen by the GREF
+ * boxes that were already resolved.
+ * @param[in] v Atom to look up
+ * @param[in] s Scope, list of variable lists (see slots()), innermost first
+ * @param[in] e Runtime environment where the scope will be evaluated
+ * @return NaN-boxed LREF, NaN-boxed GREF if it's not local, or the atom `v`
+ * itself if it's too deep for a lexical address
+ */
+static L address(L v, L s, L e) {
+    I depth = 0, i;
+
+    for (; T(s) == CONS; s = cdr(s), depth++)
+        if ((i = slot(v, car(s))) != NOT_FOUND)
+            return depth <= 0xFF && i <= 0xFF ? lref(depth, i, v) : v;
+
+    for (; T(e) == FRAME; e = ELEM(e, FRAME_PARENT), depth++)
+        if ((i = slot(v, ELEM(e, FRAME_NAMES))) != NOT_FOUND)
+            return depth <= 0xFF && i <= 0xFF ? lref(depth, i, v) : v;
+
+    return box(GREF, ord(v));
+}
+
+/**
+ * @brief Resolve the local variables of each expression of list `t`
+ * @details See resolve().
+ * @param[in] t List of expressions, the tail can be a variable
+ * @param[in] s Scope, see address()
+ * @param[in] e Runtime environment, see address()
+ * @return New list of resolved expressions
+ */
+static L resolve_list(L t, L s, L e) {
+    L x, y;
+
+    if (T(t) != CONS)
+        return resolve(t, s, e);
+
+    PROTECT(t);
+    PROTECT(s);
+    PROTECT(e);
+    x = resolve(car(t), s, e);
+    PROTECT(x);
+    y = resolve_list(cdr(t), s, e);
+    UNPROTECT(4);
+    return cons(x, y);
+}
+
+/**
+ * @brief Resolve the clauses of a `cond` form, see f_cond()
+ * @details The clauses are lists of expressions, not calls, so the head of a
+ * clause is never recognized as a special form nor folded.
+ * @param[in] t List of clauses
+ * @param[in] s Scope, see address()
+ * @param[in] e Runtime environment, see address()
+ * @return New list of resolved clauses
+ */
+static L resolve_cond(L t, L s, L e) {
+    L x, y;
+
+    if (T(t) != CONS)
+        return t;
+
+    PROTECT(t);
+    PROTECT(s);
+    PROTECT(e);
+    x = resolve_list(car(t), s, e);
+    PROTECT(x);
+    y = resolve_cond(cdr(t), s, e);
+    UNPROTECT(4);
+    return cons(x, y);
+}
+
+/**
+ * @brief Resolve the bindings and the body of a `let*` form, see f_leta()
+ * @details Each binding is a new frame with a single variable, which is only
+ * visible to the following bindings and to the body.
+ * @param[in] t List of bindings followed by the body
+ * @param[in] s Scope, see address()
+ * @param[in] e Runtime environment, see address()
+ * @return New list of resolved bindings followed by the resolved body
+ */
+static L resolve_let(L t, L s, L e) {
+    L v, x, y;
+
+    if (!let(t)) {
+        x = resolve(car(t), s, e);
+        return cons(x, nil);
+    }
+
+    PROTECT(t);
+    PROTECT(s);
+    PROTECT(e);
+    x = resolve(car(cdr(car(t))), s, e);
+    x = cons(x, nil);
+    x = cons(car(car(t)), x);
+    PROTECT(x);
+    v = car(car(t));
+    s = cons(v, s);
+    y = resolve_let(cdr(t), s, e);
+    UNPROTECT(4);
+    return cons(x, y);
+}
+
+/**
+ * @brief Replace the references to local variables in the expression `x` with
+ * their lexical addresses
+ * @details Called by f_lambda() for the body of the closures, so local
+ * variables can be accessed with local() instead of searching them by name with
+ * assoc(). The expression is not modified, a resolved copy is returned.
+ *
+ * Quoted expressions are not resolved, nor the variables of `define`, `lambda`
+ * and `let*` forms. The bodies of nested `lambda` forms are resolved with their
+ * own variables in the scope, and marked as resolved with `t` as the last cdr,
+ * `(lambda v x . t)`, so f_lambda() doesn't resolve them again.
+ *
+ * Atoms that are not local (i.e. globals) are replaced by GREF boxes, see
+ * address().
+ * @param[in] x Expression to resolve
+ * @param[in] s Scope, see address()
+ * @param[in] e Runtime environment, see address()
+ * @return Resolved expression
+ */
+static L resolve(L x, L s, L e) {
+    L f, p, y;
+    I form = FORM_CALL;
+
+    if (T(x) == ATOM)
+        return address(x, s, e);
+
+    if (T(x) != CONS)
+        return x;
+
+    /* Special forms are only recognized if their name is not local */
+    f = car(x);
+    if (T(f) == ATOM)
+        f = address(f, s, e);
+
+    if (T(f) == GREF && (p = GLOBAL(f), T(p) == PRIM)) {
+        L (*q)(L, L*) = prim[ord(p)].f;
+
+        PROTECT(x);
+        PROTECT(s);
+        PROTECT(e);
+
+        if (q == f_quote) {
+            form = FORM_QUOTE;
+            y    = cdr(x);
+        } else if (q == f_lambda) {
+            /* (lambda v y . t) */
+            form = FORM_LAMBDA;
+            y    = cons(car(cdr(x)), s);
+            y    = resolve(car(cdr(cdr(x))), y, e);
+            y    = cons(y, tru);
+            y    = cons(car(cdr(x)), y);
+        } else if (q == f_leta) {
+            /* (let* (v1 x1) (v2 x2) ... y) */
+            form = FORM_LETA;
+            y    = resolve_let(cdr(x), s, e);
+        } else if (q == f_define) {
+            /* (define v y) */
+            y = resolve_list(cdr(cdr(x)), s, e);
+            y = cons(car(cdr(x)), y);
+        } else if (q == f_cond) {
+            /* (cond (x1 y1) (x2 y2) ...) */
+            form = FORM_COND;
+            y    = resolve_cond(cdr(x), s, e);
+        } else {
+            y = resolve_list(cdr(x), s, e);
+
+            if (q == f_if)
+                form = FORM_IF;
+        }
+
+        /* Constant arithmetic is evaluated now, and its value is stored before
+         * the arguments, in case the primitive is redefined */
+        if (foldable(p, y)) {
+            PROTECT(y);
+            x = apply(prim[ord(p)].op, prim[ord(p)].n, y, nil);
+            UNPROTECT(1);
+            form = FORM_CONST;
+            y    = cons(x, y);
+        }
+
+        if (form != FORM_CALL && ord(p) <= 0xFF)
+            f = gref(f, form, p);
+
+        UNPROTECT(3);
+        return cons(f, y);
+    }
+
+    return resolve_list(x, s, e);
+}
+
+/*-------------------------------- EVALUATION --------------------------------*/
+
+/**
+ * @brief Apply a primitive operation to the values of the expressions in `t`
+ * @details The arguments are evaluated into local variables, so no list of
+ * values is consed like with evlis(). Missing arguments are ERR. See PrimPair.
+ * @param[in] op Operation of the primitive
+ * @param[in] n Number of arguments of `op`, or VARIADIC to combine all of them
+ * @param[in] t List of unevaluated arguments
+ * @param[in] e Environment of the arguments
+ * @return Result of the operation
+ */
+static L apply(L (*op)(L, L), I n, L t, L e) {
+    L x = err, y = err;
+    PROTECT(t);
+    PROTECT(e);
+    PROTECT(x);
+
+    if (T(t) == CONS) {
+        x = eval(car(t), e);
+        t = cdr(t);
+    }
+
+    if (n == VARIADIC) {
+        for (; T(t) == CONS; t = cdr(t)) {
+            y = eval(car(t), e);
+            x = op(x, y);
+        }
+    } else {
+        if (n == 2 && T(t) == CONS)
+            y = eval(car(t), e);
+
+        x = op(x, n == 2 ? y : nil);
+    }
+
+    UNPROTECT(3);
+    return x;
+}
+
+/**
+ * @brief Apply the operation of the primitive `f` to `k` values
+ * @details Used by exec(), where the values of the arguments are already on
+ * the stack of the virtual machine. Missing arguments are ERR, like in apply().
+ * @param[in] f Primitive with an operation, see PrimPair
+ * @param[in] a Values of the arguments
+ * @param[in] k Number of values
+ * @return Result of the operation
+ */
+static L combine(L f, const L* a, I k) {
+    const PrimPair* p = &prim[ord(f)];
+    L x = k > 0 ? a[0] : err;
+
+    if (p->n == VARIADIC) {
+        for (I j = 1; j < k; j++)
+            x = p->op(x, a[j]);
+
+        return x;
+    }
+
+    if (p->n == 2)
+        return p->op(x, k > 1 ? a[1] : err);
+
+    return p->op(x, nil);
+}
+
+/**
+ * @brief Evaluate `x` and return its value in environment `e`
+ * @details Closures and primitives are applied in a loop: the body of a closure
+ * and the tail expression returned by some primitives (see PrimPair) replace
+ * `x` and `e`, and are evaluated in the next iteration instead of recursing.
+ * This way, tail calls run in constant C stack.
+ * @param[in] x Expression to evaluate
+ * @param[in] e Enviroment of the expression
+ * @return Evaluated expression
+ */
+static L eval(L x, L e) {
+    const I caller = profile_current;
+    I r = NOT_FOUND;
+    L f, t;
+    PROTECT(x);
+    PROTECT(e);
+
+    if (++stats.depth > stats.max_depth)
+        stats.max_depth = stats.depth;
+
+    while (1) {
+        if (T(x) == LREF) {
+            x = local(x, e);
+            break;
+        }
+
+        if (T(x) == GREF) {
+            x = global(x);
+            break;
+        }
+
+        if (T(x) == ATOM) {
+            x = assoc(x, e);
+            break;
+        }
+
+        if (T(x) == CODE) {
+            I more;
+            x = exec(x, &e, &more);
+
+            if (more)
+                continue;
+
+            break;
+        }
+
+        if (T(x) != CONS)
+            break;
+
+        /* Look up the function without recursing, if it's a variable */
+        f = car(x);
+
+        if (T(f) == GREF) {
+            const uint64_t bits = *(uint64_t*)&f;
+            const I form        = gref_form(f);
+            f                   = global(f);
+            t                   = cdr(x);
+
+            /* Forms recognized by resolve(), while the variable is still bound
+             * to the same primitive. They are not profiled. */
+            if (form != FORM_CALL && !profiling &&
+                equ(f, box(PRIM, bits >> 40 & 0xFF))) {
+                if (form == FORM_CONST || form == FORM_QUOTE) {
+                    x = car(t);
+                    break;
+                }
+
+                if (form == FORM_IF) {
+                    f = eval(car(t), e);
+                    t = cdr(x);
+                    x = car(cdr(not(f) ? cdr(t) : t));
+                    continue;
+                }
+
+                if (form == FORM_LAMBDA) {
+                    x = f_lambda(t, &e);
+                    break;
+                }
+
+                x = form == FORM_COND ? f_cond(t, &e) : f_leta(t, &e);
+                continue;
+            }
+
+            /* Call the new value with the arguments of the folded form */
+            if (form == FORM_CONST)
+                t = cdr(t);
+        } else {
+            f = T(f) == LREF ? local(f, e) : eval(f, e);
+            t = cdr(x);
+        }
+
+        if (T(f) == PRIM) {
+            const PrimPair* p = &prim[ord(f)];
+
+            if (profiling)
+                profile_enter(ord(f));
+
+            if (p->op != NULL)
+                x = apply(p->op, p->n, t, e);
+            else
+                x = p->f(t, &e);
+
+            if (profiling)
+                profile_leave(ord(f));
+
+            if (p->t)
+                continue;
+
+            break;
+        }
+
+        if (T(f) != CLOS) {
+            if (r != NOT_FOUND) {
+                profile_leave(r);
+                profile_current = caller;
+            }
+
+            stats.depth--;
+            UNPROTECT(2);
+            err_msg("not a valid clousure or primitive");
+        }
+
+        if (memoized(f)) {
+            PROTECT(f);
+            t = evlis(t, e);
+            UNPROTECT(1);
+            x = memo_apply(f, t);
+            break;
+        }
+
+        if (profiling) {
+            I next;
+            PROTECT(f);
+            PROTECT(t);
+            next = profile_closure(f);
+            UNPROTECT(2);
+
+            x = cdr(car(f));
+            e = reduce(f, t, e);
+
+            /* The arguments were evaluated by the caller, and a tail call ends
+             * the call that was profiled in this loop */
+            if (r != NOT_FOUND)
+                profile_leave(r);
+
+            r               = next;
+            profile_current = r;
+            profile_enter(r);
+            continue;
+        }
+
+        x = cdr(car(f));
+        e = reduce(f, t, e);
+    }
+
+    if (r != NOT_FOUND) {
+        profile_leave(r);
+        profile_current = caller;
+    }
+
+    stats.depth--;
+    UNPROTECT(2);
+    return x;
+}
+
+/*-------------------------------- MEMOIZATION -------------------------------*/
+
+/**
+ * @brief Check if the closure `f` is memoized, see memoize()
+ * @details The variables of other closures can't be a vector.
+ * @param[in] f Closure
+ * @return Non-zero if `f` is memoized
+ */
+static I memoized(L f) {
+    const L v = car(car(f));
+    return T(v) == VEC;
+}
+
+/**
+ * @brief Memoized closure of `f`, with a cache of at least `n` entries
+ * @details The entries are stored in sets of MEMO_WAYS, selected by the hash of
+ * the arguments, see memo_apply(). Each set is ordered from the most recently
+ * used entry, which is the one evicted last.
+ * @param[in] f Closure, if it's memoized its original closure is used
+ * @param[in] n Number of entries
+ * @return Memoized closure
+ */
+static L memoize(L f, I n) {
+    I sets = 1;
+    L c;
+
+    if (memoized(f))
+        f = cdr(car(f));
+
+    while (sets * MEMO_WAYS < n)
+        sets *= 2;
+
+    PROTECT(f);
+    c = block(VEC, 2 * MEMO_WAYS * sets, box(HDR, 0));
+    c = cons(c, f);
+    UNPROTECT(1);
+
+    return box(CLOS, ord(cons(c, nil)));
+}
+
+/**
+ * @brief Hash of the values of the argument list `t`
+ * @details Pairs and blocks are hashed by their ordinals, like the keys of hash
+ * tables, so the hash of the same arguments can change after a collection. The
+ * entries that are not found anymore are evicted like the others.
+ * @param[in] t List of values
+ * @return Hash of the list
+ */
+static I memo_hash(L t) {
+    I h = 2166136261u;
+
+    for (; T(t) == CONS; t = cdr(t))
+        h = (h ^ keyhash(car(t))) * 16777619u;
+
+    return h ^ keyhash(t);
+}
+
+/**
+ * @brief Check if the argument lists `t` and `u` have the same values
+ * @param[in] t List of values
+ * @param[in] u List of values
+ * @return Non-zero if the values are equal, see equ()
+ */
+static I memo_equ(L t, L u) {
+    for (; T(t) == CONS && T(u) == CONS; t = cdr(t), u = cdr(u))
+        if (!equ(car(t), car(u)))
+            return 0;
+
+    return equ(t, u);
+}
+
+/**
+ * @brief Apply the memoized closure `f` to the values `t`
+ * @details If the values are in the cache, their value is returned without
+ * evaluating the body of the original closure. Otherwise the result is stored
+ * as the most recent entry of its set, evicting the least recent one.
+ * @param[in] f Memoized closure, see memoize()
+ * @param[in] t List of values
+ * @return Value of the original closure
+ */
+static L memo_apply(L f, L t) {
+    L c = car(car(f)), d, x;
+    I j = 2 * MEMO_WAYS * (memo_hash(t) & (size(c) / (2 * MEMO_WAYS) - 1));
+
+    for (I w = 0; w < 2 * MEMO_WAYS; w += 2) {
+        if (!memo_equ(ELEM(c, j + w), t))
+            continue;
+
+        /* Move the entry to the front of its set */
+        x = ELEM(c, j + w + 1);
+        for (; w > 0; w -= 2) {
+            put(c, j + w, ELEM(c, j + w - 2));
+            put(c, j + w + 1, ELEM(c, j + w - 1));
+        }
+        put(c, j, t);
+        put(c, j + 1, x);
+        return x;
+    }
+
+    PROTECT(f);
+    PROTECT(t);
+    d = cdr(car(f));
+    d = bind(car(car(d)), t, cdr(d));
+    x = eval(cdr(car(cdr(car(f)))), d);
+
+    /* The ordinals of the arguments can change while evaluating */
+    c = car(car(f));
+    j = 2 * MEMO_WAYS * (memo_hash(t) & (size(c) / (2 * MEMO_WAYS) - 1));
+    for (I w = 2 * MEMO_WAYS - 2; w > 0; w -= 2) {
+        put(c, j + w, ELEM(c, j + w - 2));
+        put(c, j + w + 1, ELEM(c, j + w - 1));
+    }
+    put(c, j, t);
+    put(c, j + 1, x);
+    UNPROTECT(2);
+
+    return x;
+}
+
+/*--------------------------------- PARSING ----------------------------------*/
+
+/**
+ * @def INPUT_CHUNK
+ * @brief Initial size of the input buffer, and number of bytes read at once
+ */
+#define INPUT_CHUNK 65536
+
+/**
+ * @name Input buffer
+ * in: characters read from standard input but not parsed yet. Tokens are
+ * parsed in place, see scan().
+ *
+ * in_len: number of characters in in[].
+ *
+ * in_size: number of allocated characters.
+ *
+ * in_pos: position of the next character to look at, the one in `see` is at
+ * (in_pos - 1).
+ *
+ * tok: start of the token being scanned, or NOT_FOUND. It's kept in the buffer
+ * when more input is read, see fill().
+ *
+ * interactive: non-zero if standard input is a terminal. Only one line is read
+ * at a time in that case, so the REPL doesn't wait for more input.
+ *
+ * mapped: non-zero if in[] is a source file mapped by map_input(), or the
+ * source given to eval_source(), instead of a buffer for standard input.
+ */
+static PER_THREAD char* in = NULL;
+static PER_THREAD I in_len = 0, in_size = 0, in_pos = 0, tok = NOT_FOUND;
+static PER_THREAD I interactive = 0, mapped = 0;
+
+/**
+ * @var buf
+ * @brief The last token read by scan(), as a null-terminated string
+ */
+static PER_THREAD char* buf = "";
+
+/**
+ * @var see
+ * @brief The next character that we are looking at (last read by look())
+ */
+static PER_THREAD char see = ' ';
+
+/**
+ * @name Input source
+ * source: file read by forms() instead of standard input, or NULL.
+ *
+ * source_end: where fill() jumps at the end of `source`, see next_form().
+ *
+ * source_eof: non-zero once a newline has been added after the end of
+ * `source`, so its last token is finished.
+ */
+static PER_THREAD FILE* source = NULL;
+static PER_THREAD jmp_buf* source_end = NULL;
+static PER_THREAD I source_eof = 0;
+
+/**
+ * @brief Stop evaluating, on EOF or with `(quit)`
+ * @details Exits in the REPL. In the library and the server, returns from
+ * eval_source() instead, see finish.
+ */
+static _Noreturn void stop(void) {
+    if (finish != NULL)
+        longjmp(*finish, 1);
+
+    exit(0);
+}
+
+/**
+ * @brief Read more input into in[]
+ * @details The characters before the token being scanned are discarded, and the
+ * token is moved to the start of the buffer. If the buffer is more than half
+ * full afterwards, it grows, so tokens can be of any length. Stops on EOF, see
+ * stop(), unless reading a file with forms().
+ */
+static void fill(void) {
+    const I start = tok == NOT_FOUND ? in_len : tok;
+    size_t n;
+
+    /* The whole input is already in the buffer */
+    if (mapped)
+        stop();
+
+    if (start > 0) {
+        memmove(in, in + start, in_len - start);
+        in_len -= start;
+        in_pos -= start;
+        if (tok != NOT_FOUND)
+            tok = 0;
+    }
+
+    /* Show the output (e.g. the prompt) before waiting for more input */
+    flush();
+
+    if (in_size == 0 || in_len * 2 > in_size) {
+        in_size = in_size ? in_size * 2 : INPUT_CHUNK;
+        in      = realloc(in, in_size);
+        if (in == NULL) {
+            fprintf(stderr, "Couldn't grow the input buffer.\n");
+            abort();
+        }
+    }
+
+    if (interactive)
+        n = fgets(in + in_len, in_size - in_len, stdin) ? strlen(in + in_len)
+                                                        : 0;
+    else
+        n = fread(in + in_len, 1, in_size - in_len,
+                  source != NULL ? source : stdin);
+
+    /* There is room for the newline, since the buffer is at most half full */
+    if (n == 0 && source != NULL) {
+        if (source_eof)
+            longjmp(*source_end, 1);
+
+        in[in_len] = '\n';
+        n = source_eof = 1;
+    }
+
+    if (n == 0)
+        stop();
+
+    in_len += n;
+}
+
+/**
+ * @brief Use the contents of the file at `path` as the input buffer
+ * @details The file is mapped into memory instead of being read, so the tokens
+ * are parsed directly from the mapping. It's private and writable, since scan()
+ * writes the terminators of the tokens, and only the pages it writes to are
+ * copied.
+ *
+ * A newline is added after the end of the file, so the last token is finished.
+ * To make sure the byte after the file can be written even if the size of the
+ * file is a multiple of the page size, the file is mapped over an anonymous
+ * mapping one byte bigger.
+ * @param[in] path Path of the source file
+ * @return Non-zero on success
+ */
+static I map_input(const char* path) {
+    struct stat st;
+    FILE* fp = fopen(path, "r");
+
+    if (fp == NULL || fstat(fileno(fp), &st) != 0 || st.st_size >= NOT_FOUND) {
+        if (fp != NULL)
+            fclose(fp);
+        return 0;
+    }
+
+    in = mmap(NULL, st.st_size + 1, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (in == MAP_FAILED ||
+        (st.st_size > 0 && mmap(in, st.st_size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_FIXED, fileno(fp),
+                                0) == MAP_FAILED)) {
+        fclose(fp);
+        return 0;
+    }
+
+    /* The mapping stays valid after closing the file */
+    fclose(fp);
+
+    in[st.st_size] = '\n';
+    in_len         = st.st_size + 1;
+    in_size        = in_len;
+    mapped         = 1;
+    return 1;
+}
+
+/**
+ * @brief Store the current character in `see` and advances to the next
+ * character
+ * @details Reads a new block of input when the buffer is empty, see fill()
+ */
+static void look(void) {
+    if (in_pos == in_len)
+        fill();
+
+    see = in[in_pos++];
+}
+
+/**
+ * @brief Check if we are looking at character c
+ * @details Character `' '` will be passed as parameter in case of *any*
+ * whitespace
+ * @param[in] c Character to check
+ * @return Non-zero if we are seeing that character
+ */
+static inline I seeing(char c) {
+    if (c == ' ')
+        return see > 0 && see <= c;
+    else
+        return see == c;
+}
+
+/**
+ * @brief Return the look ahead character from standard input, advances to the
+ * next
+ * @return Current look ahead character
+ */
+static char get(void) {
+    char c = see;
+    look();
+    return c;
+}
+
+/**
+ * @brief Tokenize input into buf[]
+ * @details The token is not copied: buf points to it in the input buffer, and
+ * the character after it (already in `see`) is replaced by a null terminator.
+ * @return First character of buf[]
+ */
+static char scan(void) {
+    while (seeing(' '))
+        look();
+
+    /* The character in `see` might have been replaced by the terminator of the
+     * previous token */
+    tok     = in_pos - 1;
+    in[tok] = see;
+
+    if (seeing('(') || seeing(')') || seeing('\'')) {
+        get();
+    } else {
+        do {
+            get();
+        } while (!seeing('(') && !seeing(')') && !seeing(' '));
+    }
+
+    in[in_pos - 1] = '\0';
+    buf            = in + tok;
+    tok            = NOT_FOUND;
+    return *buf;
+}
+
+/**
+ * @brief Scan and parse an expression from standard input
+ * @details Calls scan() and parse()
+ * @return The Lisp expression read from standard input
+ */
+static L read(void) {
+    scan();
+    return parse();
+}
+
+/**
+ * @brief Parse a Lisp list
+ * @details Uses input buffer `buf`. The elements are appended to the list as
+ * they are parsed, see setcdr(), so only nested lists recurse.
+ * @return Parsed Lisp list
+ */
+static L list(void) {
+    L head = nil, last = nil, x;
+    PROTECT(head);
+    PROTECT(last);
+
+    while (scan() != ')') {
+        const I dot = !strcmp(buf, ".");
+
+        if (dot) {
+            x = read();
+            scan();
+        } else {
+            x = parse();
+            x = cons(x, nil);
+        }
+
+        if (T(last) == NIL)
+            head = x;
+        else
+            setcdr(last, x);
+
+        if (dot)
+            break;
+
+        last = x;
+    }
+
+    UNPROTECT(2);
+    return head;
+}
+
+/**
+ * @brief Parse a Lisp expression quoted as `(quote x)`
+ * @details Uses input buffer `buf`
+ * @return Parsed quoted expression
+ */
+static L quote(void) {
+    return cons(atom("quote"), cons(read(), nil));
+}
+
+/**
+ * @brief Parse ab atomic Lisp expression
+ * @details Uses input buffer `buf`. An atomic expression is a number or an atom.
+ * Integers of up to 15 digits are always exact doubles, so they are converted
+ * directly, without going through sscanf()
+ * @return Parsed atomic Lisp expression
+ */
+static L atomic(void) {
+    const char* s = buf + (*buf == '-' || *buf == '+');
+    uint64_t k    = 0;
+    L n;
+    I i;
+
+    for (i = 0; i < 15 && s[i] >= '0' && s[i] <= '9'; i++)
+        k = 10 * k + (s[i] - '0');
+    if (i > 0 && !s[i])
+        return *buf == '-' ? -(L)k : (L)k;
+
+    if (sscanf(buf, "%lg%n", &n, &i) > 0 && !buf[i])
+        return n;
+    else
+        return atom(buf);
+}
+
+/**
+ * @brief Parse a Lisp expression
+ * @details Uses input buffer `buf`
+ * @return Parsed Lisp expression
+ */
+static L parse(void) {
+    if (*buf == '(')
+        return list();
+    else if (*buf == '\'')
+        return quote();
+    else
+        return atomic();
+}
+
+/**
+ * @brief Read the next expression of the file being read by forms()
+ * @details Like read(), but returns at the end of the file instead of stopping.
+ * An expression left unfinished at the end is discarded, along with the roots
+ * registered while parsing it.
+ * @param[out] x Expression read
+ * @return Non-zero if an expression was read, zero at the end of the file
+ */
+static I next_form(L* x) {
+    const I r = rp;
+    jmp_buf here;
+
+    if (setjmp(here) != 0) {
+        rp = r;
+        return 0;
+    }
+
+    source_end = &here;
+    *x         = read();
+    return 1;
+}
+
+/**
+ * @brief Close the file read by forms(), and go back to the input `saved`
+ * @param[in] saved State of the reader when forms() was called
+ * @param[in] fp File being read
+ */
+static void forms_end(const Input* saved, FILE* fp) {
+    fclose(fp);
+    free(in);
+    in          = saved->in;
+    in_len      = saved->len;
+    in_size     = saved->size;
+    in_pos      = saved->pos;
+    tok         = saved->tok;
+    interactive = saved->interactive;
+    mapped      = saved->mapped;
+    buf         = saved->buf;
+    see         = saved->see;
+    source      = saved->source;
+    source_end  = saved->end;
+    source_eof  = saved->eof;
+}
+
+/**
+ * @brief Apply `f` to each expression of the file at `path`, in order
+ * @details The expressions are not evaluated. They are read one at a time
+ * through an input buffer of their own (see fill()), and nothing references
+ * them after `f` returns, so a file bigger than the cell space can be processed
+ * as long as each expression fits in it. The state of the current input is
+ * restored afterwards, so `f` can read other files too.
+ *
+ * If `f` stops the evaluation in eval_source(), with `(quit)` or by running out
+ * of memory, the file is closed and the input restored before returning there,
+ * see finish.
+ *
+ * When folding, `f` is called with the value returned by the previous call
+ * (`x` for the first one) and the expression.
+ * @param[in] f Function to apply
+ * @param[in] x Initial value, when folding
+ * @param[in] path Atom with the path of the file
+ * @param[in] fold Non-zero to fold over the expressions
+ * @return Value of the last call when folding, otherwise the number of
+ * expressions. `err` if the file can't be opened.
+ */
+static L forms(L f, L x, L path, I fold) {
+    FILE* const fp       = fopen(HEAP_BOTTOM + ord(path), "r");
+    jmp_buf* const outer = finish;
+    jmp_buf here;
+    L y = nil;
+    I n = 0;
+
+    if (fp == NULL)
+        err_msg("couldn't open %s", HEAP_BOTTOM + ord(path));
+
+    /* The current input, restored afterwards */
+    const Input saved = { in,     in_len, in_size, in_pos, tok, interactive,
+                          mapped, buf,    see,     source, source_end, source_eof };
+
+    in          = NULL;
+    in_len      = 0;
+    in_size     = 0;
+    in_pos      = 0;
+    tok         = NOT_FOUND;
+    interactive = 0;
+    mapped      = 0;
+    see         = ' ';
+    source      = fp;
+    source_eof  = 0;
+
+    /* In the REPL, stop() exits and out_of_memory() aborts instead */
+    if (outer != NULL) {
+        switch (setjmp(here)) {
+        case 0:
+            finish = &here;
+            break;
+        case EVAL_MEMORY:
+            forms_end(&saved, fp);
+            finish = outer;
+            longjmp(*outer, EVAL_MEMORY);
+        default:
+            forms_end(&saved, fp);
+            finish = outer;
+            longjmp(*outer, 1);
+        }
+    }
+
+    PROTECT(f);
+    PROTECT(x);
+    PROTECT(y);
+    while (next_form(&y)) {
+        x = fold ? call2(f, x, y) : call(f, y);
+        n++;
+    }
+    UNPROTECT(3);
+
+    forms_end(&saved, fp);
+    finish = outer;
+    return fold ? x : n;
+}
+
+/*--------------------------------- PRINTING ---------------------------------*/
+
+/**
+ * @def OUTPUT_CHUNK
+ * @brief Size of the output buffer
+ */
+#define OUTPUT_CHUNK 65536
+
+/**
+ * @name Output buffer
+ * out: characters printed but not written to standard output yet. It's written
+ * when full, before reading more input (see fill()), and when exiting.
+ *
+ * out_len: number of characters in out[].
+ */
+static PER_THREAD char out[OUTPUT_CHUNK];
+static PER_THREAD I out_len = 0;
+
+/**
+ * @brief Write the output buffer to standard output
+ * @details In the library and the server, it's appended to the output of the
+ * context instead, see eval_source().
+ */
+static void flush(void) {
+    if (context != NULL) {
+        if (context->output_len + out_len >= context->output_max) {
+            size_t k = context->output_max ? context->output_max : OUTPUT_CHUNK;
+            while (context->output_len + out_len >= k)
+                k *= 2;
+
+            char* s = realloc(context->output, k);
+            if (s == NULL) {
+                fprintf(stderr, "Couldn't grow the output buffer.\n");
+                abort();
+            }
+            context->output     = s;
+            context->output_max = k;
+        }
+
+        memcpy(context->output + context->output_len, out, out_len);
+        context->output_len += out_len;
+        out_len = 0;
+        return;
+    }
+
+    fwrite(out, 1, out_len, stdout);
+    fflush(stdout);
+    out_len = 0;
+}
+
+/**
+ * @brief Print `n` characters of `s` to the output buffer
+ * @param[in] s Characters to print
+ * @param[in] n Number of characters
+ */
+static void out_mem(const char* s, I n) {
+    while (n > 0) {
+        I k = OUTPUT_CHUNK - out_len;
+        if (k == 0) {
+            flush();
+            continue;
+        }
+
+        if (k > n)
+            k = n;
+
+        memcpy(out + out_len, s, k);
+        out_len += k;
+        s += k;
+        n -= k;
+    }
+}
+
+/* print the string s to the output buffer */
+static void out_str(const char* s) {
+    out_mem(s, strlen(s));
+}
+
+/* print the character c to the output buffer */
+static void out_char(char c) {
+    if (out_len == OUTPUT_CHUNK)
+        flush();
+
+    out[out_len++] = c;
+}
+
+/* print the number n to the output buffer, see format_num() */
+static void out_num(L n) {
+    char s[32];
+    out_mem(s, format_num(n, s));
+}
+
+/**
+ * @brief Format like fprintf(), to `fp` or to the output buffer
+ * @details Used by the reports that are also printed by primitives, so they
+ * go to the output of the interpreter like print(), see flush().
+ * @param[in] fp File to write to, or NULL for the output buffer
+ * @param[in] fmt Format of printf()
+ */
+static void out_fmt(FILE* fp, const char* fmt, ...) {
+    char buf[256];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    if (fp != NULL) {
+        vfprintf(fp, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+
+    if ((size_t)n < sizeof(buf)) {
+        out_mem(buf, n);
+        return;
+    }
+
+    /* Long labels of the profiler, formatted again in a big enough buffer */
+    char* s = malloc(n + 1);
+    if (s == NULL)
+        return;
+
+    va_start(ap, fmt);
+    vsnprintf(s, n + 1, fmt, ap);
+    va_end(ap);
+    out_mem(s, n);
+    free(s);
+}
+
+/**
+ * @name Print stack
+ * pending: rest of each list being printed by print(), innermost last.
+ *
+ * pending_len: number of lists in pending[].
+ *
+ * pending_size: number of allocated elements.
+ */
+static PER_THREAD L* pending = NULL;
+static PER_THREAD I pending_len = 0, pending_size = 0;
+
+/**
+ * @brief Push the rest of a list being printed to pending[]
+ * @param[in] t Rest of the list
+ */
+static void push_pending(L t) {
+    if (pending_len == pending_size) {
+        pending_size = pending_size ? pending_size * 2 : 64;
+        pending      = realloc(pending, pending_size * sizeof(L));
+        if (pending == NULL) {
+            fprintf(stderr, "Couldn't allocate the print stack.\n");
+            abort();
+        }
+    }
+
+    pending[pending_len++] = t;
+}
+
+/**
+ * @brief Display a Lisp expression that is not a list
+ * @param[in] x Expression to print
+ */
+static void printatom(L x) {
+    /* NOTE: We don't use switch here because type tags are not constant at
+     * compile time */
+    if (T(x) == NIL) {
+        out_str("()");
+    } else if (T(x) == ATOM || T(x) == LREF || T(x) == GREF) {
+        out_str(HEAP_BOTTOM + ord(x));
+    } else if (T(x) == PRIM) {
+        out_char('<');
+        out_str(prim[ord(x)].s);
+        out_char('>');
+    } else if (T(x) == CLOS) {
+        out_char('{');
+        out_num(ord(x));
+        out_char('}');
+    } else if (T(x) == FRAME) {
+        out_char('[');
+        out_num(ord(x));
+        out_char(']');
+    } else if (T(x) == CODE) {
+        out_str("<code ");
+        out_num(ord(x));
+        out_char('>');
+    } else if (T(x) == HASH) {
+        out_str("<hash ");
+        out_num(ord(x));
+        out_char('>');
+    } else if (is_future(x)) {
+        out_str("<future ");
+        out_num(ord(x));
+        out_char('>');
+    } else if (T(x) == ARR) {
+        out_str("#f64(");
+        for (I j = 0; j < size(x); j++) {
+            if (j > 0)
+                out_char(' ');
+            out_num(AREF(x, j));
+        }
+        out_char(')');
+    } else {
+        out_num(x);
+    }
+}
+
+/**
+ * @brief Display a Lisp expression
+ * @details Lists are printed without recursing: when an element is a list, the
+ * rest of the enclosing list is pushed to pending[] and printed after it. This
+ * way, the nesting depth is not limited by the C stack. Vectors are pushed with
+ * the index of their next element, as a HDR box. Nothing is allocated while
+ * printing, so the pending lists don't need to be protected.
+ * @param[in] x Expression to print
+ */
+static void print(L x) {
+    const I base = pending_len;
+    L t;
+
+    while (1) {
+        if (T(x) == CONS) {
+            out_char('(');
+            push_pending(cdr(x));
+            x = car(x);
+            continue;
+        }
+
+        if (T(x) == VEC) {
+            out_str("#(");
+            push_pending(x);
+            push_pending(box(HDR, 0));
+        } else {
+            printatom(x);
+        }
+
+        /* Continue with the next element of the innermost list, closing the
+         * lists that end */
+        while (1) {
+            if (pending_len == base)
+                return;
+
+            t = pending[--pending_len];
+
+            if (T(t) == HDR) {
+                const L v = pending[pending_len - 1];
+                const I j = ord(t);
+
+                if (j == size(v)) {
+                    pending_len--;
+                    out_char(')');
+                    continue;
+                }
+
+                if (j > 0)
+                    out_char(' ');
+
+                push_pending(box(HDR, j + 1));
+                x = ELEM(v, j);
+                break;
+            } else if (T(t) == NIL) {
+                out_char(')');
+            } else if (T(t) == CONS) {
+                out_char(' ');
+                push_pending(cdr(t));
+                x = car(t);
+                break;
+            } else {
+                out_str(" . ");
+                push_pending(nil);
+                x = t;
+                break;
+            }
+        }
+    }
+}
+
+/*---------------------------------- IMAGES ----------------------------------*/
+
+/**
+ * @def IMAGE_MAGIC
+ * @brief First word of the images written by dump_image()
+ * @details Images of COMPACT executables have a different one, since their
+ * cells are smaller.
+ */
+#ifdef COMPACT
+#define IMAGE_MAGIC 0x544C4333u
+#else
+#define IMAGE_MAGIC 0x544C4933u
+#endif
+
+/**
+ * @var image
+ * @brief File where dump_image() will write the image, or NULL
+ */
+static const char* image = NULL;
+
+/* return the number of primitives in prim[] */
+static I prims(void) {
+    I k = 0;
+
+    while (prim[k].s != NULL)
+        k++;
+
+    return k;
+}
+
+/**
+ * @brief Make the future `f` lazy if it's queued, see lazy_futures()
+ * @param[in] f Expression, which might be a future
+ */
+static void make_lazy(L f) {
+    if (!is_future(f) || ord(ELEM(f, FUT_STATE)) != FUT_QUEUED)
+        return;
+
+    put(f, FUT_STATE, box(0, FUT_LAZY));
+    put(f, FUT_TASK, box(0, 0));
+    put(f, FUT_TASK + 1, box(0, 0));
+    put(f, FUT_OWNER, box(0, 0));
+}
+
+/**
+ * @brief Make the queued futures lazy, before writing an image
+ * @details The Task of a queued future only exists in this process, and the
+ * `id` of its owner can belong to another interpreter after loading the image,
+ * see touch(). Its expression and environment are still in the future, so it
+ * can be evaluated by touch() instead. The futures are found in the global
+ * values and in the stack, which is scanned like in collect().
+ */
+static void lazy_futures(void) {
+    for (I j = 0; j < symtab_size; j++)
+        if (symtab[j] != 0)
+            make_lazy(GLOBAL(box(ATOM, symtab[j] - 1)));
+
+    for (I i = N; i > sp;) {
+        const L h = unpack(cell[i - 1]);
+
+        if (T(h) == HDR) {
+            const I k = ord(h) & BLOCK_SIZE;
+            for (I j = i - 1 - k; j < i - 1; j++)
+                make_lazy(unpack(cell[j]));
+            i -= k + 1;
+        } else if (T(h) == RAW) {
+            i -= ARRAY_CELLS(ord(h)) + 1;
+        } else {
+            make_lazy(unpack(cell[i - 1]));
+            make_lazy(unpack(cell[i - 2]));
+            i -= 2;
+        }
+    }
+}
+
+/**
+ * @brief Write the atom heap and the stack to the file `image`
+ * @details Registered with atexit() by the `--dump-image` argument. The cells
+ * that are not reachable from the global environment are collected first, so
+ * the image only contains the atoms, their values and the cells they reference.
+ * Queued futures are saved as lazy ones, see lazy_futures().
+ *
+ * The image starts with a header of 6 words: IMAGE_MAGIC, the size of the heap
+ * in bytes, the number of cells of the stack, the number of primitives, the
+ * epoch, so hash tables know if their keys were moved (see refresh()), and the
+ * number of wide values (see pack()). The heap and the stack are stored after
+ * it, as they are in cell[], followed by the wide values. Since stack
+ * ordinals are relative to the top of cell[] (see CELL), and primitives are
+ * indexes in prim[], no ordinal needs to be changed when loading the image in
+ * the same executable.
+ */
+static void dump_image(void) {
+    I header[6];
+    FILE* fp;
+
+    /* We are exiting, nothing else is in use */
+    rp      = 0;
+    vp      = 0;
+    ops_len = 0;
+    gc();
+    lazy_futures();
+
+    header[0] = IMAGE_MAGIC;
+    header[1] = hp;
+    header[2] = N - sp;
+    header[3] = prims();
+    header[4] = epoch;
+    header[5] = wide_len;
+
+    fp = fopen(image, "wb");
+    if (fp == NULL || fwrite(header, sizeof(header), 1, fp) != 1 ||
+        fwrite(cell, 1, hp, fp) != hp ||
+        fwrite(cell + sp, sizeof(C), N - sp, fp) != N - sp ||
+        fwrite(wide, sizeof(L), wide_len, fp) != wide_len) {
+        fprintf(stderr, "Couldn't write the image to %s.\n", image);
+        if (fp != NULL)
+            fclose(fp);
+        return;
+    }
+
+    fclose(fp);
+}
+
+/**
+ * @brief Replace the atom heap and the stack with the ones of an image written
+ * by dump_image()
+ * @details The image is mapped into memory and copied to cell[], which grows if
+ * the image doesn't fit. All the loaded cells are old. The symbol table is
+ * rebuilt from the atom names in the heap.
+ * @param[in] path Path of the image
+ * @return Non-zero on success
+ */
+static I load_image(const char* path) {
+    struct stat st;
+    FILE* fp = fopen(path, "rb");
+    I* header;
+    I i, j, size;
+
+    if (fp == NULL)
+        return 0;
+
+    if (fstat(fileno(fp), &st) != 0 || st.st_size < (off_t)(6 * sizeof(I))) {
+        fclose(fp);
+        return 0;
+    }
+
+    header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    fclose(fp);
+    if (header == MAP_FAILED)
+        return 0;
+
+    if (header[0] != IMAGE_MAGIC || header[3] != prims() ||
+        st.st_size != (off_t)(6 * sizeof(I) + header[1] +
+                              (uint64_t)header[2] * sizeof(C) +
+                              (uint64_t)header[5] * sizeof(L))) {
+        munmap(header, st.st_size);
+        return 0;
+    }
+
+    while (header[1] / sizeof(C) + header[2] + nursery > N)
+        grow();
+
+    hp     = header[1];
+    sp     = N - header[2];
+    old_sp = sp;
+    epoch  = header[4];
+    memcpy(cell, header + 6, hp);
+    memcpy(cell + sp, (char*)(header + 6) + hp, header[2] * sizeof(C));
+
+    if (header[5] > wide_size) {
+        wide_size = header[5];
+        wide      = realloc(wide, wide_size * sizeof(L));
+        if (wide == NULL) {
+            fprintf(stderr, "Couldn't allocate the wide values.\n");
+            abort();
+        }
+    }
+    wide_len = header[5];
+    memcpy(wide, (char*)(header + 6) + hp + header[2] * sizeof(C),
+           wide_len * sizeof(L));
+    munmap(header, st.st_size);
+
+    /* Each atom is its global value followed by its padded name, see atom() */
+    free(symtab);
+    symtab      = NULL;
+    symtab_size = 0;
+    symtab_used = 0;
+    rehash(SYMTAB_MIN);
+
+    for (i = 0; i < hp; i += size) {
+        const char* s = HEAP_BOTTOM + i + sizeof(C);
+
+        for (j = strhash(s) & (symtab_size - 1); symtab[j] != 0;
+             j = (j + 1) & (symtab_size - 1))
+            ;
+
+        symtab[j] = i + sizeof(C) + 1;
+        if (++symtab_used * 2 > symtab_size)
+            rehash(symtab_size * 2);
+
+        size = sizeof(C) + (strlen(s) + sizeof(C)) / sizeof(C) * sizeof(C);
+    }
+
+    return 1;
+}
+
+/*--------------------------------- PROFILER ---------------------------------*/
+
+/**
+ * @name Fixed profiler records
+ * PROFILE_LAMBDA: closures that were never defined under a name, placed after
+ * the records of the primitives. PROFILE_TOP: allocations outside of any call.
+ */
+#define PROFILE_LAMBDA (prims())
+#define PROFILE_TOP    (prims() + 1)
+
+/* return a monotonic time in nanoseconds */
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * @brief Add an empty record to profile[]
+ * @param[in] label Name of the record, or NULL
+ * @param[in] name Atom closures were defined under, if `label` is NULL
+ * @return Index of the record
+ */
+static I profile_add(const char* label, L name) {
+    if (profile_len == profile_size) {
+        profile_size = profile_size ? profile_size * 2 : 64;
+        profile      = realloc(profile, profile_size * sizeof(Profile));
+        if (profile == NULL) {
+            fprintf(stderr, "Couldn't allocate the profiler records.\n");
+            abort();
+        }
+    }
+
+    memset(&profile[profile_len], 0, sizeof(Profile));
+    profile[profile_len].label = label;
+    profile[profile_len].name  = name;
+    return profile_len++;
+}
+
+/**
+ * @brief Create the records of the primitives and the fixed records
+ * @details Called by main() when profiling is enabled.
+ */
+static void profile_init(void) {
+    for (I i = 0; prim[i].s != NULL; i++)
+        profile_add(prim[i].s, nil);
+
+    profile_add("<lambda>", nil);
+    profile_add("<top>", nil);
+    profile_current = PROFILE_TOP;
+
+    profiled = table();
+    PROTECT(profiled);
+}
+
+/**
+ * @brief Remember that the closure `x` was defined under the atom `v`
+ * @details Called by f_define(). Closures defined under the same name share
+ * the same record.
+ * @param[in] v Atom
+ * @param[in] x Value of the atom
+ */
+static void profile_define(L v, L x) {
+    L r;
+
+    if (T(x) != CLOS)
+        return;
+
+    PROTECT(x);
+    r = hash_get(profiled, v, nil);
+    if (T(r) == NIL) {
+        r = box(0, profile_add(NULL, v));
+        hash_put(profiled, v, r);
+    }
+    UNPROTECT(1);
+
+    hash_put(profiled, x, r);
+}
+
+/* return the index of the record of the closure f */
+static I profile_closure(L f) {
+    L r = hash_get(profiled, f, nil);
+    return T(r) == NIL ? PROFILE_LAMBDA : ord(r);
+}
+
+/**
+ * @brief Start a call profiled in the record `r`
+ * @details Called by eval(). The time of a call includes the evaluation of the
+ * arguments of primitives, and the calls made by closures, except for tail
+ * calls, which end the call of the closure. Only the outermost call of a record
+ * is timed, so the time of recursive calls is not counted twice.
+ *
+ * Allocations are attributed to profile_current, the innermost closure being
+ * called, which eval() sets itself.
+ * @param[in] r Index of the record
+ */
+static void profile_enter(I r) {
+    profile[r].calls++;
+    if (profile[r].active++ == 0)
+        profile[r].start = now();
+}
+
+/**
+ * @brief End a call profiled in the record `r`, see profile_enter()
+ * @param[in] r Index of the record
+ */
+static void profile_leave(I r) {
+    if (--profile[r].active == 0)
+        profile[r].ns += now() - profile[r].start;
+}
+
+/* compare the indexes of two records by decreasing time, for qsort() */
+static int profile_cmp(const void* a, const void* b) {
+    const uint64_t x = profile[*(const I*)a].ns, y = profile[*(const I*)b].ns;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/**
+ * @brief Write the records of the profiler to `fp`, sorted by time
+ * @details The time of the active calls is included up to now. Records without
+ * calls nor allocations are omitted.
+ * @param[in] fp File to write to, or NULL for the output buffer, see out_fmt()
+ */
+static void profile_report(FILE* fp) {
+    const uint64_t t = now();
+    I* order         = malloc(profile_len * sizeof(I));
+    I k              = 0;
+
+    if (order == NULL)
+        return;
+
+    for (I i = 0; i < profile_len; i++) {
+        if (profile[i].active > 0) {
+            profile[i].ns += t - profile[i].start;
+            profile[i].start = t;
+        }
+
+        if (profile[i].calls > 0 || profile[i].conses > 0)
+            order[k++] = i;
+    }
+
+    qsort(order, k, sizeof(I), profile_cmp);
+
+    out_fmt(fp, "%12s %12s %12s  %s\n", "calls", "ms", "conses", "function");
+    for (I i = 0; i < k; i++) {
+        const Profile* p = &profile[order[i]];
+        out_fmt(fp, "%12llu %12.3f %12llu  %s\n", (unsigned long long)p->calls,
+                p->ns / 1e6, (unsigned long long)p->conses,
+                p->label != NULL ? p->label : HEAP_BOTTOM + ord(p->name));
+    }
+
+    free(order);
+}
+
+/**
+ * @brief Write the profiler report to the standard error when exiting
+ * @details Registered with atexit() by the `-p` argument.
+ */
+static void profile_exit(void) {
+    flush();
+    fprintf(stderr, "\n");
+    profile_report(stderr);
+}
+
+/*-------------------------------- STATISTICS --------------------------------*/
+
+/**
+ * @brief Write the counters of the allocator, the garbage collector and eval()
+ * to `fp`
+ * @param[in] fp File to write to, or NULL for the output buffer, see out_fmt()
+ */
+static void print_stats(FILE* fp) {
+    out_fmt(fp, "cells        %u\n", N);
+    out_fmt(fp, "heap bytes   %u\n", hp);
+    out_fmt(fp, "atoms        %u\n", symtab_used);
+    out_fmt(fp, "stack cells  %u\n", N - sp);
+    out_fmt(fp, "live cells   %u (at most %u)\n", stats.live, stats.max_live);
+    out_fmt(fp, "conses       %llu\n", (unsigned long long)stats.conses);
+    out_fmt(fp, "blocks       %llu\n", (unsigned long long)stats.blocks);
+    out_fmt(fp, "eval depth   %u (at most %u)\n", stats.depth, stats.max_depth);
+    out_fmt(fp, "collections  %llu minor, %llu full\n",
+            (unsigned long long)stats.minors, (unsigned long long)stats.majors);
+    out_fmt(fp, "gc time      %.3f ms (at most %.3f ms)\n", stats.gc_ns / 1e6,
+            stats.max_ns / 1e6);
+    out_fmt(fp, "grows        %llu\n", (unsigned long long)stats.grows);
+}
+
+/**
+ * @brief Write the statistics to the standard error when exiting
+ * @details Registered with atexit() by the `TINYLISP_STATS` environment
+ * variable.
+ */
+static void stats_exit(void) {
+    flush();
+    fprintf(stderr, "\n");
+    print_stats(stderr);
+}
+
+/*---------------------------------- THREADS ---------------------------------*/
+
+/**
+ * @def FROM
+ * @brief Expression in the cell with ordinal `i` in the cell space of the
+ * interpreter `w`, like CELL
+ */
+#define FROM(w, i) unpack_in((w)->wide, (w)->cell[(w)->N - (i)])
+
+/**
+ * @brief Append `x` to the array `*a`, of `*len` elements and `*size` allocated
+ * @param[in,out] a Pointer to the array
+ * @param[in,out] len Pointer to the number of elements
+ * @param[in,out] size Pointer to the number of allocated elements
+ * @param[in] x Expression to append
+ */
+static void append(L** a, I* len, I* size, L x) {
+    if (*len == *size) {
+        *size = *size ? *size * 2 : 64;
+        *a    = realloc(*a, *size * sizeof(L));
+        if (*a == NULL) {
+            fprintf(stderr, "Couldn't allocate the cells to import.\n");
+            abort();
+        }
+    }
+
+    (*a)[(*len)++] = x;
+}
+
+/**
+ * @brief Pairs and blocks of this thread referenced by the expression `x` of
+ * the cell space of `w`
+ * @details The cells with ordinals up to `limit` were copied from this thread
+ * by clone(), and are still at the same ordinals in both, so they don't need
+ * to be copied by import(). The cells of `w` reachable from `x` are visited
+ * depth-first, with a bitmap of the visited ordinals.
+ * @param[in] w Interpreter where `x` is stored
+ * @param[in] limit Greatest ordinal of the cells copied from this thread
+ * @param[in] x Expression of `w`
+ * @param[in,out] found Pointer to an array where the references are appended
+ * @param[in,out] len Pointer to the number of elements of `*found`
+ * @param[in,out] size Pointer to the number of allocated elements
+ */
+static void shared(const TinyLisp* w, I limit, L x, L** found, I* len,
+                   I* size) {
+    uint8_t* seen = calloc(w->N / 8 + 1, 1);
+    L* stack      = NULL;
+    I sn = 0, ss = 0;
+
+    if (seen == NULL) {
+        fprintf(stderr, "Couldn't allocate the cells to import.\n");
+        abort();
+    }
+
+    append(&stack, &sn, &ss, x);
+    while (sn > 0) {
+        x = stack[--sn];
+        if (!is_pair(x) && !is_block(x))
+            continue;
+
+        const I i = ord(x);
+        if (seen[i / 8] & 1 << i % 8)
+            continue;
+        seen[i / 8] |= 1 << i % 8;
+
+        if (i <= limit) {
+            append(found, len, size, x);
+        } else if (is_pair(x)) {
+            append(&stack, &sn, &ss, FROM(w, i - 1));
+            append(&stack, &sn, &ss, FROM(w, i));
+        } else if (T(x) != ARR) {
+            const I k = ord(FROM(w, i)) & BLOCK_SIZE;
+            for (I j = 0; j < k; j++)
+                append(&stack, &sn, &ss, FROM(w, i + 1 + j));
+        }
+    }
+
+    free(stack);
+    free(seen);
+}
+
+/**
+ * @brief Copy of the expression `x` of the cell space of `w`, without its
+ * elements
+ * @details Used by import(). Atoms that were already in this thread's heap
+ * (bellow `base`) have the same ordinal in both, and the others are looked up
+ * by name. Pairs and blocks are allocated here, and added to `todo` to copy
+ * their elements later, except arrays, which are copied at once. The copies are
+ * stored in the hash table `memo`, indexed by the ordinal in `w`, so shared and
+ * circular structures are copied only once.
+ * @param[in] w Interpreter where `x` is stored
+ * @param[in] base Size of the heap that `w` shares with this thread
+ * @param[in] x Expression to copy
+ * @param[in] memo Hash table of the copies
+ * @param[in,out] todo Pointer to the list of copies without their elements
+ * @return Copy of `x` in this thread's cell space
+ */
+static L import_cell(const TinyLisp* w, I base, L x, L memo, L* todo) {
+    const L key = box(0, ord(x));
+    uint64_t bits;
+    L d;
+
+    if (T(x) == ATOM || T(x) == GREF || T(x) == LREF) {
+        if (ord(x) < base)
+            return x;
+
+        /* Keep the tag, and the lexical address of LREF boxes */
+        d    = atom((const char*)w->cell + ord(x));
+        bits = (*(uint64_t*)&x & ~0xFFFFFFFFull) | ord(d);
+        return *(L*)&bits;
+    }
+
+    if (!is_pair(x) && !is_block(x))
+        return x;
+
+    d = hash_get(memo, key, nil);
+    if (T(d) != NIL)
+        return d;
+
+    PROTECT(memo);
+    if (is_pair(x)) {
+        d = cons(nil, nil);
+        d = box(T(x), ord(d));
+    } else if (T(x) == HASH) {
+        d = table();
+    } else {
+        const I k = ord(FROM(w, ord(x))) & BLOCK_SIZE;
+
+        if (T(x) == ARR) {
+            d = array(k, 0);
+            memcpy(elems(d),
+                   ALIGNED(&w->cell[w->N - ord(x) - ARRAY_CELLS(k)]),
+                   k * sizeof(L));
+        } else {
+            d = block(T(x), k, nil);
+        }
+    }
+
+    PROTECT(d);
+    hash_put(memo, key, d);
+    if (T(d) != ARR) {
+        x     = cons(d, key);
+        *todo = cons(x, *todo);
+    }
+    UNPROTECT(2);
+
+    return d;
+}
+
+/**
+ * @brief Copy the expression `x` of the cell space of `w` to this thread's
+ * @details Used to get the results of the workers, see import_all(). The cells
+ * of `w`
+ * are only read, and `w` must not be evaluating. The pairs and blocks that
+ * must not be copied, because they were already in this thread, are in `memo`
+ * at first, see shared().
+ * @param[in] w Interpreter where `x` is stored
+ * @param[in] base Size of the heap that `w` shares with this thread
+ * @param[in] x Expression to copy
+ * @param[in] memo Hash table of the copies, indexed by the ordinal in `w`
+ * @return Copy of `x`
+ */
+static L import(const TinyLisp* w, I base, L x, L memo) {
+    L todo = nil, d, y, z;
+    PROTECT(memo);
+    PROTECT(todo);
+    x = import_cell(w, base, x, memo, &todo);
+    PROTECT(x);
+
+    /* Copy the elements of the pairs and blocks allocated so far, which can
+     * add more of them to the list */
+    while (T(todo) == CONS) {
+        const I i = ord(cdr(car(todo)));
+        d         = car(car(todo));
+        todo      = cdr(todo);
+        PROTECT(d);
+
+        if (is_pair(d)) {
+            y = import_cell(w, base, FROM(w, i - 1), memo, &todo);
+            PROTECT(y);
+            z = import_cell(w, base, FROM(w, i), memo, &todo);
+            UNPROTECT(1);
+
+            SET_CELL(ord(d) - 1, y);
+            SET_CELL(ord(d), z);
+            if ((young(y) || young(z)) && !young(d))
+                remember(d);
+        } else if (T(d) == HASH) {
+            /* The keys are hashed again, since the ordinals can change */
+            const L s = FROM(w, i + 1 + HASH_SLOTS);
+            const I k = ord(FROM(w, ord(s))) & BLOCK_SIZE;
+
+            for (I j = 0; j < k; j += 2) {
+                L key = FROM(w, ord(s) + 1 + j);
+                if (T(key) == HDR)
+                    continue;
+
+                y = import_cell(w, base, key, memo, &todo);
+                PROTECT(y);
+                z = import_cell(w, base, FROM(w, ord(s) + 2 + j), memo, &todo);
+                hash_put(d, y, z);
+                UNPROTECT(1);
+            }
+        } else {
+            for (I j = 0; j < size(d); j++) {
+                y = import_cell(w, base, FROM(w, i + 1 + j), memo, &todo);
+                put(d, j, y);
+            }
+
+            /* The task of a queued future is only valid in its owner, so the
+             * copy evaluates the expression itself when touched */
+            if (is_future(d) && ord(ELEM(d, FUT_STATE)) != FUT_DONE) {
+                put(d, FUT_STATE, box(0, FUT_LAZY));
+                put(d, FUT_TASK, box(0, 0));
+                put(d, FUT_TASK + 1, box(0, 0));
+            }
+        }
+
+        UNPROTECT(1);
+    }
+
+    UNPROTECT(3);
+    return x;
+}
+
+/**
+ * @brief Copy the expressions `xs` of the cell spaces `ws` to this thread's
+ * @details Used to get the results of pmap() and of the futures. First, the
+ * cells of this thread that are referenced by the expressions are found, and
+ * protected before allocating, while their ordinals are the same as in the
+ * copies, see shared(). Then each expression is copied, see import().
+ * @param[in] n Number of expressions
+ * @param[in] ws Interpreters where the expressions are stored
+ * @param[in] xs Expressions to copy
+ * @param[in] base Size of the heap that the interpreters share with this thread
+ * @param[in] limit Greatest ordinal of the cells copied from this thread that
+ * are still at the same ordinal here, or zero
+ * @return Vector of the copies, in the same order
+ */
+static L import_all(I n, const TinyLisp** ws, const L* xs, I base, I limit) {
+    jmp_buf* const outer = finish;
+    jmp_buf here;
+    L* found = NULL;
+    I* first = malloc((n + 1) * sizeof(I));
+    I len_found = 0, size_found = 0;
+
+    if (first == NULL) {
+        fprintf(stderr, "Couldn't allocate the cells to import.\n");
+        abort();
+    }
+
+    for (I i = 0; i < n; i++) {
+        first[i] = len_found;
+        shared(ws[i], limit, xs[i], &found, &len_found, &size_found);
+    }
+    first[n] = len_found;
+
+    /* Free the references when running out of memory while copying, before
+     * returning to the evaluation, see out_of_memory() */
+    if (outer != NULL) {
+        if (setjmp(here) != 0) {
+            free(found);
+            free(first);
+            finish = outer;
+            longjmp(*outer, EVAL_MEMORY);
+        }
+        finish = &here;
+    }
+
+    for (I j = 0; j < len_found; j++)
+        PROTECT(found[j]);
+
+    L r = block(VEC, n, nil);
+    PROTECT(r);
+    for (I i = 0; i < n; i++) {
+        L memo = table();
+        PROTECT(memo);
+        for (I j = first[i]; j < first[i + 1]; j++)
+            hash_put(memo, box(0, ord(found[j])), found[j]);
+
+        const L x = import(ws[i], base, xs[i], memo);
+        put(r, i, x);
+        UNPROTECT(1);
+    }
+    UNPROTECT(len_found + 1);
+
+    finish = outer;
+    free(found);
+    free(first);
+    return r;
+}
+
+/**
+ * @brief Make a copy `tl` of the interpreter `from`
+ * @details The copy has its own cell space, symbol table and statistics, so
+ * a worker can load it and allocate without affecting `from`, which must not be
+ * evaluating while it's copied. All the copied cells are old, so the
+ * remembered set starts empty. The copy can always grow, since it's only used
+ * for a while by a worker.
+ * @param[out] tl Copy
+ * @param[in] from Interpreter to copy
+ */
+static void clone(TinyLisp* tl, const TinyLisp* from) {
+    *tl = *from;
+
+    tl->cell   = malloc(tl->N * sizeof(C));
+    tl->symtab = malloc(tl->symtab_size * sizeof(I));
+    tl->wide   = malloc(tl->wide_size * sizeof(L));
+    if (tl->cell == NULL || tl->symtab == NULL ||
+        (tl->wide_size > 0 && tl->wide == NULL)) {
+        fprintf(stderr, "Couldn't allocate %u cells for a worker.\n", tl->N);
+        abort();
+    }
+
+    memcpy(tl->cell, from->cell, tl->hp);
+    memcpy(tl->cell + tl->sp, from->cell + tl->sp,
+           (tl->N - tl->sp) * sizeof(C));
+    memcpy(tl->symtab, from->symtab, tl->symtab_size * sizeof(I));
+    if (tl->wide_len > 0)
+        memcpy(tl->wide, from->wide, tl->wide_len * sizeof(L));
+
+    tl->spare      = NULL;
+    tl->old_sp     = tl->sp;
+    tl->dirty      = NULL;
+    tl->dirty_len  = 0;
+    tl->dirty_size = 0;
+    tl->growable   = 1;
+    tl->id         = fresh_id();
+    tl->tasks      = NULL;
+    memset(&tl->stats, 0, sizeof(Stats));
+}
+
+/**
+ * @brief Free the cell space of the copy `tl`, see clone()
+ * @param[in] tl Copy
+ */
+static void release(TinyLisp* tl) {
+    free(tl->cell);
+    free(tl->spare);
+    free(tl->symtab);
+    free(tl->dirty);
+    free(tl->wide);
+}
+
+/**
+ * @brief New value for the `id` of an interpreter
+ * @return Identifier, unique in the process
+ */
+static I fresh_id(void) {
+    pthread_mutex_lock(&pool_lock);
+    const I r = ++contexts;
+    pthread_mutex_unlock(&pool_lock);
+    return r;
+}
+
+/* return f applied to x, without evaluating x again */
+static L call(L f, L x) {
+    PROTECT(f);
+    x = cons(x, nil);
+    x = cons(atom("quote"), x);
+    x = cons(x, nil);
+    UNPROTECT(1);
+    return eval(cons(f, x), nil);
+}
+
+/* return f applied to x and y, without evaluating them again */
+static L call2(L f, L x, L y) {
+    PROTECT(f);
+    PROTECT(x);
+    y = cons(y, nil);
+    y = cons(atom("quote"), y);
+    y = cons(y, nil);
+    PROTECT(y);
+    x = cons(x, nil);
+    x = cons(atom("quote"), x);
+    y = cons(x, y);
+    UNPROTECT(3);
+    return eval(cons(f, y), nil);
+}
+
+/**
+ * @brief Empty the stacks of this thread, after an evaluation that might have
+ * been stopped by stop() or out_of_memory()
+ * @details The garbage collector roots, the bytecode buffers and the print
+ * stack of the evaluation are dropped, see finish.
+ */
+static void unwind(void) {
+    finish      = NULL;
+    rp          = 0;
+    ops_len     = 0;
+    vp          = 0;
+    pending_len = 0;
+    stats.depth = 0;
+}
+
+/**
+ * @brief Apply the function of the chunk `c` to its elements
+ * @details Called by the workers, in a copy of the cell space of the caller,
+ * see clone(). The results are stored in a vector, and the state of the copy
+ * is saved in the chunk.
+ *
+ * If the function calls `(quit)` or runs out of memory, the rest of the chunk
+ * is not evaluated, and its status is set instead of the results, see pmap().
+ * @param[in,out] c Chunk to evaluate
+ */
+static void evaluate(Chunk* c) {
+    jmp_buf here;
+
+    clone(&c->arena, c->from);
+    context_load(&c->arena);
+
+    switch (setjmp(here)) {
+    case 0:
+        finish = &here;
+
+        /* The elements of each chunk are different, so they can be roots */
+        PROTECT(c->f);
+        for (I i = 0; i < c->len; i++)
+            PROTECT(c->args[i]);
+
+        c->results = block(VEC, c->len, nil);
+        PROTECT(c->results);
+        for (I i = 0; i < c->len; i++) {
+            const L x = call(c->f, c->args[i]);
+            put(c->results, i, x);
+        }
+        UNPROTECT(c->len + 2);
+        break;
+    case EVAL_MEMORY:
+        c->status = EVAL_MEMORY;
+        break;
+    default:
+        c->status = EVAL_QUIT;
+    }
+
+    unwind();
+    abandon(tasks);
+    tasks = NULL;
+    flush();
+    context_save(&c->arena);
+}
+
+/**
+ * @brief Evaluate the expression of the task `t`
+ * @details Called by the workers, in the copy of the cell space of the owner
+ * made by spawn(). The futures spawned by the expression that were not touched
+ * are abandoned, since the copy is only used to get the value.
+ *
+ * Like in evaluate(), `(quit)` and running out of memory stop the task, and
+ * set its status instead of the value, see touch().
+ * @param[in,out] t Task to evaluate
+ */
+static void run(Task* t) {
+    jmp_buf here;
+
+    context_load(&t->arena);
+
+    switch (setjmp(here)) {
+    case 0:
+        finish = &here;
+        PROTECT(t->x);
+        PROTECT(t->e);
+        t->value = eval(t->x, t->e);
+        UNPROTECT(2);
+        break;
+    case EVAL_MEMORY:
+        t->status = EVAL_MEMORY;
+        break;
+    default:
+        t->status = EVAL_QUIT;
+    }
+
+    unwind();
+    abandon(tasks);
+    tasks = NULL;
+    flush();
+    context_save(&t->arena);
+}
+
+/**
+ * @brief Queue the task `t` at the bottom of the deque of this thread
+ * @details Called with pool_lock held. The deque is created and added to
+ * `deques` the first time.
+ * @param[in] t Task to queue
+ */
+static void push(Task* t) {
+    if (deque == NULL) {
+        deque = calloc(1, sizeof(Deque));
+        if (deque == NULL) {
+            fprintf(stderr, "Couldn't allocate a deque.\n");
+            abort();
+        }
+
+        deque->next = deques;
+        deques      = deque;
+    }
+
+    if (deque->bottom == deque->size) {
+        /* Reuse the space of the stolen tasks before growing */
+        if (deque->top > 0) {
+            memmove(deque->tasks, deque->tasks + deque->top,
+                    (deque->bottom - deque->top) * sizeof(Task*));
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        } else {
+            deque->size  = deque->size ? deque->size * 2 : 16;
+            deque->tasks = realloc(deque->tasks, deque->size * sizeof(Task*));
+            if (deque->tasks == NULL) {
+                fprintf(stderr, "Couldn't allocate a deque.\n");
+                abort();
+            }
+        }
+    }
+
+    deque->tasks[deque->bottom++] = t;
+    t->deque                      = deque;
+    t->state                      = TASK_QUEUED;
+    pool_queued++;
+}
+
+/**
+ * @brief Take the oldest task of any deque
+ * @details Called with pool_lock held, by the workers.
+ * @return Task, now running, or NULL if all the deques are empty
+ */
+static Task* steal(void) {
+    for (Deque* d = deques; d != NULL; d = d->next) {
+        if (d->top == d->bottom)
+            continue;
+
+        Task* t  = d->tasks[d->top++];
+        t->state = TASK_RUNNING;
+        t->deque = NULL;
+        pool_queued--;
+        return t;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Remove the queued task `t` from its deque
+ * @details Called with pool_lock held. Tasks are usually touched in the reverse
+ * order they were spawned, so `t` is searched from the bottom.
+ * @param[in] t Queued task
+ */
+static void unqueue(Task* t) {
+    Deque* d = t->deque;
+    I j      = d->bottom;
+
+    while (d->tasks[--j] != t)
+        ;
+
+    memmove(d->tasks + j, d->tasks + j + 1,
+            (d->bottom - j - 1) * sizeof(Task*));
+    d->bottom--;
+    t->deque = NULL;
+    pool_queued--;
+}
+
+/**
+ * @brief Free the tasks of the list `t`, whose futures won't be touched
+ * @details The tasks that are running are freed by their worker when they
+ * finish, see work().
+ * @param[in] t List of tasks, linked by `next`
+ */
+static void abandon(Task* t) {
+    pthread_mutex_lock(&pool_lock);
+    while (t != NULL) {
+        Task* next = t->next;
+
+        if (t->state == TASK_RUNNING) {
+            t->abandoned = 1;
+        } else {
+            if (t->state == TASK_QUEUED)
+                unqueue(t);
+
+            release(&t->arena);
+            free(t);
+        }
+
+        t = next;
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * @brief Main loop of the worker threads of the pool
+ * @details Evaluates the chunks of pool_queue, or else the tasks stolen from the
+ * deques, until the program exits.
+ * @param[in] arg Unused
+ * @return Never returns
+ */
+static void* work(void* arg) {
+    (void)arg;
+    worker = 1;
+
+    pthread_mutex_lock(&pool_lock);
+    while (1) {
+        Chunk* c = pool_queue;
+        Task* t  = NULL;
+
+        if (c == NULL && (t = steal()) == NULL) {
+            pool_idle++;
+            pthread_cond_wait(&pool_work, &pool_lock);
+            pool_idle--;
+            continue;
+        }
+
+        if (c != NULL)
+            pool_queue = c->next;
+        pthread_mutex_unlock(&pool_lock);
+
+        if (c != NULL)
+            evaluate(c);
+        else
+            run(t);
+
+        pthread_mutex_lock(&pool_lock);
+        if (c != NULL) {
+            --*c->pending;
+        } else if (t->abandoned) {
+            release(&t->arena);
+            free(t);
+        } else {
+            t->state = TASK_DONE;
+        }
+        pthread_cond_broadcast(&pool_done);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Start worker threads until there are `n` of them
+ * @details Called with pool_lock held. If a thread can't be started, the ones
+ * that are already running are used.
+ * @param[in] n Number of workers
+ */
+static void pool_start(I n) {
+    for (; pool_size < n; pool_size++) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, work, NULL) != 0)
+            break;
+
+        pthread_detach(thread);
+    }
+}
+
+/**
+ * @brief Free the `n` chunks `cs` of a pmap() call, with the copies of the cell
+ * space of the workers, and the arrays passed to import_all()
+ * @param[in] n Number of chunks
+ * @param[in] cs Chunks
+ * @param[in] ws Interpreters of the chunks
+ * @param[in] xs Results of the chunks
+ */
+static void pmap_end(I n, Chunk* cs, const TinyLisp** ws, L* xs) {
+    for (I i = 0; i < n; i++)
+        release(&cs[i].arena);
+
+    free(ws);
+    free(xs);
+    free(cs);
+}
+
+/**
+ * @brief List of the results of applying `f` to the elements of the list `t`
+ * @details The list is split in a chunk for each thread, evaluated by the
+ * workers of the pool in copies of the cell space, see evaluate(). Then the
+ * results are copied here, see import(). Definitions and other side effects of
+ * `f` are not seen by the caller nor by the other chunks. If `f` calls `(quit)`
+ * or runs out of memory in a worker, the result is `err`.
+ *
+ * With a single thread, with less than two elements, or inside of a worker,
+ * the elements are evaluated here, one after the other.
+ * @param[in] f Function to apply
+ * @param[in] t List of arguments
+ * @return List of the results, in the same order
+ */
+static L pmap(L f, L t) {
+    jmp_buf* const outer = finish;
+    jmp_buf here;
+    I n = threads, len = 0, status = EVAL_END;
+    L r = nil, last = nil, x;
+
+    if (n == 0)
+        n = get_nprocs();
+
+    for (x = t; T(x) == CONS; x = cdr(x))
+        len++;
+
+    if (n < 2 || len < 2 || worker) {
+        PROTECT(f);
+        PROTECT(t);
+        PROTECT(r);
+        PROTECT(last);
+        for (; T(t) == CONS; t = cdr(t)) {
+            x = call(f, car(t));
+            x = cons(x, nil);
+
+            if (T(last) == NIL)
+                r = x;
+            else
+                setcdr(last, x);
+
+            last = x;
+        }
+        UNPROTECT(4);
+        return r;
+    }
+
+    if (n > len)
+        n = len;
+
+    L* args             = malloc(len * sizeof(L));
+    Chunk* cs           = calloc(n, sizeof(Chunk));
+    const TinyLisp** ws = malloc(n * sizeof(TinyLisp*));
+    L* xs               = malloc(n * sizeof(L));
+    if (args == NULL || cs == NULL || ws == NULL || xs == NULL) {
+        fprintf(stderr, "Couldn't allocate the chunks of pmap.\n");
+        abort();
+    }
+
+    for (I i = 0; T(t) == CONS; t = cdr(t))
+        args[i++] = car(t);
+
+    /* Nothing is allocated here until the workers are done, so they can copy
+     * the cell space while it doesn't change */
+    TinyLisp from = { 0 };
+    I pending     = n;
+    context_save(&from);
+
+    pthread_mutex_lock(&pool_lock);
+    pool_start(n);
+    for (I i = 0; i < n; i++) {
+        cs[i].from    = &from;
+        cs[i].f       = f;
+        cs[i].args    = args + (uint64_t)len * i / n;
+        cs[i].len     = (uint64_t)len * (i + 1) / n - (uint64_t)len * i / n;
+        cs[i].pending = &pending;
+        cs[i].next    = pool_queue;
+        pool_queue    = &cs[i];
+    }
+    pthread_cond_broadcast(&pool_work);
+
+    while (pending > 0)
+        pthread_cond_wait(&pool_done, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+    free(args);
+
+    for (I i = 0; i < n; i++) {
+        ws[i] = &cs[i].arena;
+        xs[i] = cs[i].results;
+        if (cs[i].status != EVAL_END)
+            status = cs[i].status;
+    }
+
+    if (status != EVAL_END) {
+        pmap_end(n, cs, ws, xs);
+        err_msg("a worker %s",
+                status == EVAL_QUIT ? "quit" : "ran out of memory");
+    }
+
+    /* Free the chunks when running out of memory while copying, before
+     * returning to the evaluation, see out_of_memory() */
+    if (outer != NULL) {
+        if (setjmp(here) != 0) {
+            pmap_end(n, cs, ws, xs);
+            finish = outer;
+            longjmp(*outer, EVAL_MEMORY);
+        }
+        finish = &here;
+    }
+
+    /* Copy the vectors of results, and append their elements */
+    L parts = import_all(n, ws, xs, from.hp, from.N - from.sp);
+    finish  = outer;
+    pmap_end(n, cs, ws, xs);
+
+    PROTECT(parts);
+    PROTECT(r);
+    for (I i = n; i-- > 0;)
+        for (I j = size(ELEM(parts, i)); j-- > 0;)
+            r = cons(ELEM(ELEM(parts, i), j), r);
+    UNPROTECT(2);
+
+    return r;
+}
+
+/**
+ * @brief Future of the expression `x` in the environment `e`
+ * @details If a worker of the pool is idle, a task is queued in the deque of
+ * this thread, with a copy of the cell space, so the worker can steal it and
+ * evaluate `x` in parallel, like pmap(). Otherwise the future is lazy, and `x`
+ * is evaluated when it's touched, so spawning is cheap when all the threads are
+ * busy already, see touch().
+ * @param[in] x Expression to evaluate
+ * @param[in] e Environment
+ * @return Future
+ */
+static L spawn(L x, L e) {
+    I n = threads;
+    L f;
+
+    PROTECT(x);
+    PROTECT(e);
+    f = block(FUT, FUT_SIZE, box(0, 0));
+    UNPROTECT(2);
+    put(f, FUT_VALUE, x);
+    put(f, FUT_ENV, e);
+    put(f, FUT_OWNER, box(0, id));
+
+    if (n == 0)
+        n = get_nprocs();
+    if (n < 2)
+        return f;
+
+    pthread_mutex_lock(&pool_lock);
+    pool_start(n - 1);
+    const I idle = pool_idle > pool_queued;
+    pthread_mutex_unlock(&pool_lock);
+
+    if (!idle)
+        return f;
+
+    /* After a minor collection, all the cells are old, and keep their
+     * ordinals until the next full collection, so the value can reference them
+     * instead of copies */
+    Task* t       = calloc(1, sizeof(Task));
+    TinyLisp from = { 0 };
+    if (t == NULL) {
+        fprintf(stderr, "Couldn't allocate a task.\n");
+        abort();
+    }
+
+    PROTECT(f);
+    minor();
+    UNPROTECT(1);
+
+    context_save(&from);
+    clone(&t->arena, &from);
+    t->x      = ELEM(f, FUT_VALUE);
+    t->e      = ELEM(f, FUT_ENV);
+    t->limit  = N - sp;
+    t->base   = hp;
+    t->majors = stats.majors;
+    t->next   = tasks;
+    tasks     = t;
+
+    put(f, FUT_STATE, box(0, FUT_QUEUED));
+    put(f, FUT_TASK, box(0, (I)(uintptr_t)t));
+    put(f, FUT_TASK + 1, box(0, (I)((uint64_t)(uintptr_t)t >> 32)));
+
+    pthread_mutex_lock(&pool_lock);
+    push(t);
+    pthread_cond_signal(&pool_work);
+    pthread_mutex_unlock(&pool_lock);
+
+    return f;
+}
+
+/**
+ * @brief Value of the future `f`
+ * @details A lazy future, or one whose task was not stolen yet, is evaluated
+ * here. Otherwise this thread waits for the worker, and copies the value, see
+ * import_all(). Futures copied from other interpreters are evaluated here too,
+ * since their tasks belong to the original. Other expressions are returned as
+ * they are.
+ *
+ * If the expression calls `(quit)` or runs out of memory in the worker, the
+ * value of the future is `err`.
+ * @param[in] f Future
+ * @return Value of its expression
+ */
+static L touch(L f) {
+    jmp_buf* const outer = finish;
+    jmp_buf here;
+    Task* t  = NULL;
+    I status = EVAL_END;
+    L x;
+
+    if (!is_future(f))
+        return f;
+
+    if (ord(ELEM(f, FUT_STATE)) == FUT_DONE)
+        return ELEM(f, FUT_VALUE);
+
+    if (ord(ELEM(f, FUT_STATE)) == FUT_QUEUED &&
+        ord(ELEM(f, FUT_OWNER)) == id) {
+        t = (Task*)(uintptr_t)((uint64_t)ord(ELEM(f, FUT_TASK + 1)) << 32 |
+                               ord(ELEM(f, FUT_TASK)));
+
+        /* Forget the task, it's only referenced by `f` */
+        Task** p = &tasks;
+        while (*p != NULL && *p != t)
+            p = &(*p)->next;
+
+        /* Not a task of this interpreter, evaluate it lazily instead */
+        if (*p == NULL) {
+            t = NULL;
+        } else {
+            *p = t->next;
+
+            pthread_mutex_lock(&pool_lock);
+            if (t->state == TASK_QUEUED) {
+                unqueue(t);
+                release(&t->arena);
+                free(t);
+                t = NULL;
+            } else {
+                while (t->state != TASK_DONE)
+                    pthread_cond_wait(&pool_done, &pool_lock);
+            }
+            pthread_mutex_unlock(&pool_lock);
+        }
+    }
+
+    put(f, FUT_STATE, box(0, FUT_LAZY));
+    put(f, FUT_TASK, box(0, 0));
+    put(f, FUT_TASK + 1, box(0, 0));
+
+    if (t != NULL)
+        status = t->status;
+
+    /* Free the task when running out of memory while copying, before
+     * returning to the evaluation, see out_of_memory() */
+    if (t != NULL && outer != NULL) {
+        if (setjmp(here) != 0) {
+            release(&t->arena);
+            free(t);
+            finish = outer;
+            longjmp(*outer, EVAL_MEMORY);
+        }
+        finish = &here;
+    }
+
+    PROTECT(f);
+    if (t != NULL) {
+        const TinyLisp* w = &t->arena;
+        x                 = err;
+        if (status == EVAL_END) {
+            x = import_all(1, &w, &t->value, t->base,
+                           t->majors == stats.majors ? t->limit : 0);
+            x = ELEM(x, 0);
+        }
+
+        finish = outer;
+        release(&t->arena);
+        free(t);
+    } else {
+        x = eval(ELEM(f, FUT_VALUE), ELEM(f, FUT_ENV));
+    }
+    UNPROTECT(1);
+
+    put(f, FUT_VALUE, x);
+    put(f, FUT_ENV, nil);
+    put(f, FUT_STATE, box(0, FUT_DONE));
+
+    if (status != EVAL_END)
+        err_msg("the worker %s",
+                status == EVAL_QUIT ? "quit" : "ran out of memory");
+
+    return x;
+}
+
+/*------------------------------ INITIALIZATION ------------------------------*/
+
+/**
+ * @brief Allocate N cells and initialize the global environment
+ * @details We initialize the predefined atoms (`nil`, `err` and `tru`), and add
+ * them and the primitives to the global enviroment, unless they are loaded from
+ * an image. Used by main() and tl_new().
+ * @param[in] load Image to load the environment from, or NULL
+ * @return Non-zero on success
+ */
+static I init(const char* load) {
+#ifdef COMPACT
+    /* The numbers of the arrays are aligned by their ordinals, see elems() */
+    N += N & 1;
+#endif
+
+    if (N > MAX_CELLS) {
+        fprintf(stderr, "Can't address %u cells.\n", N);
+        return 0;
+    }
+
+    cell = malloc(N * sizeof(C));
+    if (cell == NULL) {
+        fprintf(stderr, "Couldn't allocate %u cells.\n", N);
+        return 0;
+    }
+    sp      = N;
+    old_sp  = N;
+    nursery = N / 4 < NURSERY_CELLS ? N / 4 : NURSERY_CELLS;
+    id      = fresh_id();
+
+    nil = box(NIL, 0);
+
+    if (load != NULL) {
+        if (!load_image(load)) {
+            fprintf(stderr, "Couldn't load the image %s.\n", load);
+            return 0;
+        }
+
+        /* The primitives were already defined in the image */
+        err = atom("ERR");
+        tru = atom("t");
+    } else {
+        err = atom("ERR");
+        tru = atom("t");
+
+        /* The global value of ERR was initialized before err itself */
+        define(err, err);
+        define(tru, tru);
+
+        for (I i = 0; prim[i].s != NULL; i++)
+            define(atom(prim[i].s), box(PRIM, i));
+    }
+
+    return 1;
+}
+
+/*---------------------------------- LIBRARY ---------------------------------*/
+
+/**
+ * @brief Load the state of the interpreter `tl` into the globals of this thread
+ * @param[in] tl Interpreter, see TinyLisp
+ */
+static void context_load(const TinyLisp* tl) {
+    cell        = tl->cell;
+    spare       = tl->spare;
+    wide        = tl->wide;
+    wide_len    = tl->wide_len;
+    wide_size   = tl->wide_size;
+    wide_limit  = tl->wide_limit;
+    N           = tl->N;
+    hp          = tl->hp;
+    sp          = tl->sp;
+    old_sp      = tl->old_sp;
+    nursery     = tl->nursery;
+    epoch       = tl->epoch;
+    growable    = tl->growable;
+    compiling   = tl->compiling;
+    id          = tl->id;
+    tasks       = tl->tasks;
+    symtab      = tl->symtab;
+    symtab_size = tl->symtab_size;
+    symtab_used = tl->symtab_used;
+    dirty       = tl->dirty;
+    dirty_len   = tl->dirty_len;
+    dirty_size  = tl->dirty_size;
+    nil         = tl->nil;
+    tru         = tl->tru;
+    err         = tl->err;
+    stats       = tl->stats;
+}
+
+/**
+ * @brief Save the globals of this thread as the state of the interpreter `tl`
+ * @param[out] tl Interpreter, see TinyLisp
+ */
+static void context_save(TinyLisp* tl) {
+    tl->cell        = cell;
+    tl->spare       = spare;
+    tl->wide        = wide;
+    tl->wide_len    = wide_len;
+    tl->wide_size   = wide_size;
+    tl->wide_limit  = wide_limit;
+    tl->N           = N;
+    tl->hp          = hp;
+    tl->sp          = sp;
+    tl->old_sp      = old_sp;
+    tl->nursery     = nursery;
+    tl->epoch       = epoch;
+    tl->growable    = growable;
+    tl->compiling   = compiling;
+    tl->id          = id;
+    tl->tasks       = tasks;
+    tl->symtab      = symtab;
+    tl->symtab_size = symtab_size;
+    tl->symtab_used = symtab_used;
+    tl->dirty       = dirty;
+    tl->dirty_len   = dirty_len;
+    tl->dirty_size  = dirty_size;
+    tl->nil         = nil;
+    tl->tru         = tru;
+    tl->err         = err;
+    tl->stats       = stats;
+}
+
+/**
+ * @brief Evaluate the `k` characters at `src` in the interpreter `tl`
+ * @details The values are printed to the output of `tl`, each one followed by
+ * a newline. The input buffer of this thread is used, so it must not be reading
+ * from a file. Used by tl_eval_string() and the server.
+ * @param[in,out] tl Interpreter
+ * @param[in] src Expressions to evaluate
+ * @param[in] k Number of characters
+ * @return EVAL_END at the end of `src`, EVAL_QUIT if stopped by `(quit)`, or
+ * EVAL_MEMORY if the cell space ran out, see out_of_memory()
+ */
+static I eval_source(TinyLisp* tl, const char* src, size_t k) {
+    jmp_buf here;
+    volatile I reading = 0;
+    I r;
+
+    /* The buffers of this thread are empty between evaluations, see TinyLisp */
+    if (k + 1 >= NOT_FOUND) {
+        fprintf(stderr, "The source is too long.\n");
+        abort();
+    }
+    if (k + 1 > in_size) {
+        in_size = k + 1;
+        in      = realloc(in, in_size);
+        if (in == NULL) {
+            fprintf(stderr, "Couldn't grow the input buffer.\n");
+            abort();
+        }
+    }
+
+    /* A newline is added, so the last token is finished, see map_input() */
+    memcpy(in, src, k);
+    in[k]  = '\n';
+    in_len = k + 1;
+    in_pos = 0;
+    tok    = NOT_FOUND;
+    see    = ' ';
+    mapped = 1;
+
+    context_load(tl);
+    context        = tl;
+    tl->output_len = 0;
+
+    /* Evaluate until stop() is called at the end of the input, while reading.
+     * It can also be called by (quit) inside of eval(), and out_of_memory()
+     * returns here too, so the stacks are emptied after returning. */
+    switch (setjmp(here)) {
+    case 0:
+        finish = &here;
+        while (1) {
+            reading = 1;
+            L x     = read();
+            reading = 0;
+            print(eval(x, nil));
+            out_char('\n');
+        }
+    case EVAL_MEMORY:
+        r = EVAL_MEMORY;
+        break;
+    default:
+        r = reading ? EVAL_END : EVAL_QUIT;
+    }
+
+    unwind();
+    flush();
+    context = NULL;
+    context_save(tl);
+
+    /* There is always room for the terminator, see flush() */
+    tl->output[tl->output_len] = '\0';
+    return r;
+}
+
+/**
+ * @brief Free the interpreter `tl` and its futures
+ * @details Used by tl_free() and the server.
+ * @param[in] tl Interpreter
+ */
+static void context_free(TinyLisp* tl) {
+    abandon(tl->tasks);
+    release(tl);
+    free(tl->output);
+    free(tl);
+}
+
+#ifdef TINYLISP_LIBRARY
+TinyLisp* tl_new(unsigned cells, unsigned flags) {
+    jmp_buf here;
+    TinyLisp* tl = calloc(1, sizeof(TinyLisp));
+    if (tl == NULL)
+        return NULL;
+
+    /* A new interpreter starts with the default values of the globals */
+    tl->N         = cells != 0 ? cells : DEFAULT_CELLS;
+    tl->growable  = (flags & TL_GROW) != 0;
+    tl->compiling = (flags & TL_COMPILE) != 0;
+    context_load(tl);
+
+    /* The cells can be too few for the primitives, see out_of_memory() */
+    if (setjmp(here) == 0) {
+        finish = &here;
+        if (init(NULL)) {
+            finish = NULL;
+            context_save(tl);
+            return tl;
+        }
+    }
+
+    finish = NULL;
+    rp     = 0;
+    context_save(tl);
+    context_free(tl);
+    return NULL;
+}
+
+const char* tl_eval_string(TinyLisp* tl, const char* src) {
+    if (eval_source(tl, src, strlen(src)) == EVAL_MEMORY)
+        return NULL;
+
+    return tl->output;
+}
+
+void tl_free(TinyLisp* tl) {
+    if (tl != NULL)
+        context_free(tl);
+}
+#endif    // TINYLISP_LIBRARY
+
+/*---------------------------------- SERVER ----------------------------------*/
+
+#ifndef TINYLISP_LIBRARY
+
+/**
+ * @def SERVER_EVENTS
+ * @brief Maximum number of events handled after each wait, see serve()
+ */
+#define SERVER_EVENTS 64
+
+/**
+ * @brief Find the whole expressions received by `c`
+ * @details Follows the tokens of scan() from where the last call stopped, and
+ * updates `c->complete` after each expression of the top level. A quote is not
+ * an expression by itself, so it's completed by the one after it.
+ * @param[in,out] c Client
+ */
+static void client_scan(Client* c) {
+    for (; c->scanned < c->in_len; c->scanned++) {
+        const char ch   = c->in[c->scanned];
+        const I   space = ch > 0 && ch <= ' ';
+
+        if (c->atom && (space || ch == '(' || ch == ')')) {
+            c->atom = 0;
+            if (c->depth == 0)
+                c->complete = c->scanned;
+        }
+
+        if (ch == '(') {
+            c->depth++;
+        } else if (ch == ')') {
+            /* An unmatched parenthesis is read as an atom */
+            if (c->depth > 0)
+                c->depth--;
+            if (c->depth == 0)
+                c->complete = c->scanned + 1;
+        } else if (!space && ch != '\'') {
+            c->atom = 1;
+        }
+    }
+}
+
+/**
+ * @brief Wait for `events` on the socket of `c`
+ * @param[in] ep Epoll instance of the server
+ * @param[in,out] c Client
+ * @param[in] events EPOLLIN to receive, or EPOLLOUT to send
+ */
+static void client_wait(int ep, Client* c, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+
+    if (c->events != events && epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev) == 0)
+        c->events = events;
+}
+
+/**
+ * @brief Close the connection of `c`, and free its interpreter
+ * @param[in] c Client
+ */
+static void client_close(Client* c) {
+    net_close(c->fd);
+    context_free(c->tl);
+    free(c->in);
+    free(c);
+}
+
+/**
+ * @brief Send the output of `c` not sent yet
+ * @details If the socket is full, waits until it can send more. Otherwise,
+ * evaluates the next expressions received, or closes the connection if
+ * finished.
+ * @param[in] ep Epoll instance of the server
+ * @param[in,out] c Client
+ */
+static void client_write(int ep, Client* c) {
+    while (c->out_pos < c->tl->output_len) {
+        const ssize_t n = net_send(c->fd, c->tl->output + c->out_pos,
+                                   c->tl->output_len - c->out_pos);
+        if (n > 0) {
+            c->out_pos += n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            client_wait(ep, c, EPOLLOUT);
+            return;
+        } else if (n == 0 || errno != EINTR) {
+            client_close(c);
+            return;
+        }
+    }
+
+    if (c->closing)
+        client_close(c);
+    else
+        client_wait(ep, c, EPOLLIN);
+}
+
+/**
+ * @brief Evaluate the whole expressions received by `c`, and send their values
+ * @details All of them are evaluated at once, so the values of pipelined
+ * expressions are sent together. When the client has finished sending, the
+ * rest of the characters are evaluated too. The output must have been sent.
+ *
+ * If the interpreter of `c` runs out of memory, the error is sent after the
+ * values, and only this connection is closed, see out_of_memory().
+ * @param[in] ep Epoll instance of the server
+ * @param[in,out] c Client
+ */
+static void client_eval(int ep, Client* c) {
+    const size_t k = c->eof ? c->in_len : c->complete;
+
+    if (k > 0) {
+        const I r = eval_source(c->tl, c->in, k);
+
+        /* The values printed before are sent, followed by the error */
+        if (r == EVAL_MEMORY) {
+            context = c->tl;
+            out_str("Ran out of memory.\n");
+            flush();
+            context = NULL;
+        }
+
+        if (r != EVAL_END)
+            c->closing = 1;
+
+        memmove(c->in, c->in + k, c->in_len - k);
+        c->in_len -= k;
+        c->scanned -= k;
+        c->complete = 0;
+        c->out_pos  = 0;
+    }
+
+    if (c->eof)
+        c->closing = 1;
+
+    client_write(ep, c);
+}
+
+/**
+ * @brief Receive the characters available on the socket of `c`
+ * @details Then evaluates the whole expressions, see client_eval().
+ * @param[in] ep Epoll instance of the server
+ * @param[in,out] c Client
+ */
+static void client_read(int ep, Client* c) {
+    while (!c->eof) {
+        if (c->in_len == c->in_size) {
+            c->in_size = c->in_size ? c->in_size * 2 : INPUT_CHUNK;
+            c->in      = realloc(c->in, c->in_size);
+            if (c->in == NULL) {
+                fprintf(stderr, "Couldn't grow the input buffer.\n");
+                abort();
+            }
+        }
+
+        const ssize_t n = net_recv(c->fd, c->in + c->in_len,
+                                   c->in_size - c->in_len);
+        if (n > 0) {
+            c->in_len += n;
+        } else if (n == 0) {
+            c->eof = 1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            client_close(c);
+            return;
+        }
+    }
+
+    client_scan(c);
+    if (c->complete > 0 || c->eof)
+        client_eval(ep, c);
+}
+
+/**
+ * @brief Accept the pending connections of the socket `fd`
+ * @details Each one gets a copy of the interpreter `warm`, see clone().
+ * @param[in] ep Epoll instance of the server
+ * @param[in] fd Listening socket
+ * @param[in] warm Interpreter of the server
+ */
+static void client_accept(int ep, int fd, const TinyLisp* warm) {
+    int s;
+
+    while ((s = net_accept(fd)) >= 0) {
+        Client* c = calloc(1, sizeof(Client));
+        if (c == NULL || (c->tl = malloc(sizeof(TinyLisp))) == NULL) {
+            fprintf(stderr, "Couldn't allocate a connection.\n");
+            abort();
+        }
+
+        /* Unlike the copies of the workers, it's used until it's closed */
+        clone(c->tl, warm);
+        c->tl->growable   = warm->growable;
+        c->tl->output     = NULL;
+        c->tl->output_len = 0;
+        c->tl->output_max = 0;
+        c->fd             = s;
+        c->events         = EPOLLIN;
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, s, &ev) != 0)
+            client_close(c);
+    }
+}
+
+/**
+ * @brief Evaluate the expressions received on `addr`, instead of reading
+ * standard input
+ * @details The connections are handled by a single thread, waiting with epoll.
+ * Each one evaluates in its own interpreter, which is a copy of the current one
+ * after evaluating the source file given to main(), if any. The definitions
+ * of a connection are kept until it's closed, and are not seen by the others.
+ *
+ * The whole expressions received are evaluated in order, and their values are
+ * sent back, each one followed by a newline, without prompts. The client can
+ * send more expressions without waiting for the values. A connection is closed
+ * after evaluating `(quit)`, when its interpreter runs out of memory, or when
+ * the client closes its side.
+ * @param[in] addr Address to listen on, see net_listen()
+ * @param[in] prelude Non-zero if the input buffer has a source file to evaluate
+ * first, see map_input()
+ * @return Exit code, on error
+ */
+static int serve(const char* addr, I prelude) {
+    const int fd   = net_listen(addr);
+    const int ep   = epoll_create1(EPOLL_CLOEXEC);
+    TinyLisp* warm = calloc(1, sizeof(TinyLisp));
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    struct epoll_event events[SERVER_EVENTS];
+
+    if (fd < 0 || ep < 0 || warm == NULL ||
+        epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        fprintf(stderr, "Couldn't listen on %s.\n", addr);
+        return 1;
+    }
+
+    context_save(warm);
+
+    /* The source file is evaluated like the input of a connection, with a
+     * buffer of its own */
+    if (prelude) {
+        char* const src = in;
+        const I k       = in_len;
+
+        in      = NULL;
+        in_len  = 0;
+        in_size = 0;
+        mapped  = 0;
+        eval_source(warm, src, k);
+        munmap(src, k);
+        fwrite(warm->output, 1, warm->output_len, stdout);
+        fflush(stdout);
+    }
+
+    while (1) {
+        const int n = epoll_wait(ep, events, SERVER_EVENTS, -1);
+
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "Couldn't wait for the connections.\n");
+            return 1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            Client* c = events[i].data.ptr;
+
+            if (c == NULL)
+                client_accept(ep, fd, warm);
+            else if (c->events == EPOLLOUT)
+                client_write(ep, c);
+            else
+                client_read(ep, c);
+        }
+    }
+}
+
+#endif    // TINYLISP_LIBRARY
+
+/*----------------------------------- MAIN -----------------------------------*/
+
+#ifndef TINYLISP_LIBRARY
+
+/**
+ * @brief Print the command-line usage of the REPL
+ * @param[in] self Name of the executable, argv[0]
+ */
+static void usage(const char* self) {
+    fprintf(stderr,
+            "Usage: %s [-n CELLS] [-g] [-c] [-p] [-j THREADS]\n"
+            "          [--load-image IMAGE] [--dump-image IMAGE]\n"
+            "          [--listen ADDRESS] [FILE]\n"
+            "  -n CELLS  Number of cells for the stack and atom heap (default %u)\n"
+            "  -g        Grow the cell space when full, instead of aborting\n"
+            "  -c        Compile closures to bytecode\n"
+            "  -p        Profile the calls, and report them when exiting\n"
+            "  -j THREADS  Number of threads used by pmap and spawn (default\n"
+            "            one per processor)\n"
+            "  FILE      Evaluate the expressions of FILE and print their values,\n"
+            "            instead of starting the REPL\n"
+            "  --load-image IMAGE  Start with the environment saved in IMAGE\n"
+            "  --dump-image IMAGE  Save the environment to IMAGE when exiting\n"
+            "  --listen ADDRESS  Evaluate the expressions sent to ADDRESS, a Unix\n"
+            "            socket if it contains a '/', otherwise [HOST:]PORT, after\n"
+            "            evaluating FILE\n"
+            "The TINYLISP_CELLS, TINYLISP_GROW, TINYLISP_COMPILE,\n"
+            "TINYLISP_PROFILE and TINYLISP_THREADS environment variables can be\n"
+            "used instead of the arguments.\n",
+            self, DEFAULT_CELLS);
+}
+
+/**
+ * @brief Entry point of the REPL
+ * @details We parse the arguments and initialize the cell space and the global
+ * environment, see init(). Then we start the main loop, or the server, see
+ * serve().
+ * @param[in] argc Number of arguments
+ * @param[in] argv Argument vector
+ * @return Exit code
+ */
+int main(int argc, char** argv) {
+    const char *opt, *path = NULL, *load = NULL, *addr = NULL;
+
+    if ((opt = getenv("TINYLISP_CELLS")) != NULL)
+        N = strtoul(opt, NULL, 0);
+
+    if ((opt = getenv("TINYLISP_GROW")) != NULL && *opt != '\0')
+        growable = 1;
+
+    if ((opt = getenv("TINYLISP_COMPILE")) != NULL && *opt != '\0')
+        compiling = 1;
+
+    if ((opt = getenv("TINYLISP_PROFILE")) != NULL && *opt != '\0')
+        profiling = 1;
+
+    if ((opt = getenv("TINYLISP_THREADS")) != NULL)
+        threads = strtoul(opt, NULL, 0);
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            N = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-g")) {
+            growable = 1;
+        } else if (!strcmp(argv[i], "-c")) {
+            compiling = 1;
+        } else if (!strcmp(argv[i], "-p")) {
+            profiling = 1;
+        } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            threads = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "--load-image") && i + 1 < argc) {
+            load = argv[++i];
+        } else if (!strcmp(argv[i], "--dump-image") && i + 1 < argc) {
+            image = argv[++i];
+        } else if (!strcmp(argv[i], "--listen") && i + 1 < argc) {
+            addr = argv[++i];
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (N == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (path != NULL) {
+        if (!map_input(path)) {
+            fprintf(stderr, "Couldn't load %s.\n", path);
+            return 1;
+        }
+    } else {
+        struct stat st;
+        interactive = fstat(fileno(stdin), &st) == 0 && S_ISCHR(st.st_mode);
+    }
+
+    if (!init(load))
+        return 1;
+
+    /* The calls of compiled closures are not seen by eval(), so the profiler
+     * only measures the interpreter */
+    if (profiling) {
+        compiling = 0;
+        profile_init();
+    }
+
+    /* Registered first, so it's called last */
+    atexit(flush);
+
+    if (profiling)
+        atexit(profile_exit);
+
+    if ((opt = getenv("TINYLISP_STATS")) != NULL && *opt != '\0')
+        atexit(stats_exit);
+
+    if (image != NULL)
+        atexit(dump_image);
+
+    if (addr != NULL)
+        return serve(addr, path != NULL);
+
+    if (path == NULL)
+        out_str("--- TinyLisp REPL ---");
+
+    /* Without a file, read from standard input with a prompt */
+    while (1) {
+        if (path == NULL) {
+            out_str("\n[");
+            out_num(sp - hp / sizeof(C));
+            out_str("]> ");
+        }
+
+        L x = read();
+        print(eval(x, nil));
+
+        if (path != NULL)
+            out_char('\n');
     }
 }
+#endif    // TINYLISP_LIBRARY
@@ -41,11 +41,185 @@ typedef uint32_t I;
  * `t`       | list
  * `f`       | function or Lisp primitive
  * `p`       | pair, a cons of two Lisp expressions
- * `e`,`d`   | environment, a list of pairs, e.g. created with (define v x)
+ * `e`,`d`   | local environment, a list of frames, e.g. created with (let* (v x) y)
  * `v`       | the name of a variable (an atom) or a list of variables
  */
 typedef double L;
 
+/**
+ * @def C
+ * @brief Cell of the stack or of the atom heap, holding a Lisp expression
+ * @details Normally the same as L. When COMPACT is defined, cells are 32 bit,
+ * so a pair only takes 8 bytes, and expressions are converted with pack() and
+ * unpack() when they are stored and loaded. Variables are named like the ones
+ * of type L.
+ */
+#ifdef COMPACT
+typedef uint32_t C;
+#else
+typedef L C;
+#endif
+
+/**
+ * @struct Profile
+ * @brief Counters of a primitive or closure, see profile_enter()
+ * @details Closures are identified by the atom `name` they were defined under,
+ * and primitives and the other records by their `label`.
+ */
+typedef struct {
+    const char* label; /* Name of the record, or NULL to use `name` */
+    L name;            /* Atom of the closures of the record */
+    uint64_t calls;    /* Number of calls */
+    uint64_t ns;       /* Nanoseconds spent in the outermost calls */
+    uint64_t conses;   /* Pairs allocated by the record itself */
+    uint64_t start;    /* Start of the outermost active call */
+    I active;          /* Number of active calls */
+} Profile;
+
+/**
+ * @struct Stats
+ * @brief Counters of the allocator, the garbage collector and eval()
+ * @details Always updated, and printed by print_stats().
+ */
+typedef struct {
+    uint64_t conses; /* Pairs allocated by cons() */
+    uint64_t blocks; /* Blocks allocated by block() */
+    uint64_t minors; /* Minor collections, see minor() */
+    uint64_t majors; /* Full collections, see gc() */
+    uint64_t grows;  /* Number of times the cell space grew, see grow() */
+    uint64_t gc_ns;  /* Nanoseconds spent collecting garbage */
+    uint64_t max_ns; /* Longest collection, in nanoseconds */
+    I live;          /* Cells in use after the last collection */
+    I max_live;      /* Maximum of `live` */
+    I depth;         /* Number of active calls to eval() */
+    I max_depth;     /* Maximum of `depth` */
+} Stats;
+
+/**
+ * @struct TinyLisp
+ * @brief State of an interpreter created by tl_new() (see libtinylisp.h), or
+ * of a connection to the server, see serve()
+ * @details The fields are saved copies of the globals with the same names,
+ * which are loaded while the interpreter is evaluating, see context_load().
+ * The buffers that are always empty between two evaluations (the garbage
+ * collector roots, the bytecode buffers, the print stack and the input buffer)
+ * are not saved, and are shared by all the interpreters of a thread.
+ */
+struct TinyLisp {
+    C* cell;
+    C* spare;
+    L* wide;
+    I wide_len, wide_size, wide_limit;
+    I N, hp, sp, old_sp, nursery, epoch;
+    I growable, compiling, id;
+    struct Task* tasks;
+    I* symtab;
+    I symtab_size, symtab_used;
+    L* dirty;
+    I dirty_len, dirty_size;
+    L nil, tru, err;
+    Stats stats;
+    char* output;      /* Values printed by the last eval_source() */
+    size_t output_len; /* Number of characters in `output` */
+    size_t output_max; /* Number of allocated characters */
+};
+
+/**
+ * @struct Chunk
+ * @brief Part of the list of a `pmap` call, evaluated by a worker thread
+ * @details The worker evaluates in its own copy of the cell space of the
+ * caller, so the function and the elements are valid there. Its state is saved
+ * in `arena` afterwards, until the caller copies the results back, see
+ * import().
+ */
+typedef struct Chunk {
+    const TinyLisp* from; /* State of the caller */
+    L f;                  /* Function to apply */
+    L* args;              /* Elements of the list */
+    I len;                /* Number of elements */
+    I* pending;           /* Chunks of the same call that are not finished */
+    TinyLisp arena;       /* State of the worker, after evaluating */
+    L results;            /* Vector of the results, in `arena` */
+    I status;             /* EVAL_END, or how the worker stopped */
+    struct Chunk* next;   /* Next chunk in pool_queue */
+} Chunk;
+
+/**
+ * @struct Task
+ * @brief Expression of a future, evaluated by a worker thread, see spawn()
+ * @details Like a Chunk, the worker evaluates in a copy of the cell space of
+ * the owner, made when the future was created. The owner copies the value back
+ * when the future is touched, see touch().
+ */
+typedef struct Task {
+    TinyLisp arena;       /* Copy of the owner, and state of the worker */
+    L x, e;               /* Expression and environment, in `arena` */
+    L value;              /* Value of `x`, in `arena` */
+    I status;             /* EVAL_END, or how the worker stopped */
+    I state;              /* TASK_QUEUED, TASK_RUNNING or TASK_DONE */
+    I limit;              /* Cells of the owner's stack that are old */
+    I base;               /* Size of the owner's heap */
+    uint64_t majors;      /* Full collections of the owner, see gc() */
+    I abandoned;          /* Freed by the worker, nobody will touch it */
+    struct Deque* deque;  /* Deque where it's queued */
+    struct Task* next;    /* Next task of the same owner, see abandon() */
+} Task;
+
+/**
+ * @struct Deque
+ * @brief Tasks queued by a thread, see spawn()
+ * @details The owner pushes and removes tasks at the bottom, and idle workers
+ * steal the oldest ones from the top, which are usually the biggest, see
+ * steal().
+ */
+typedef struct Deque {
+    Task** tasks;       /* Queued tasks, from `top` to `bottom` */
+    I top, bottom;      /* Range of `tasks` in use */
+    I size;             /* Number of allocated elements */
+    struct Deque* next; /* Next deque in `deques` */
+} Deque;
+
+/**
+ * @struct Input
+ * @brief State of the reader, kept while reading a file with forms()
+ * @details See the input buffer and the input source.
+ */
+typedef struct {
+    char* in;           /* Input buffer */
+    I len, size, pos;   /* Used and allocated characters, next position */
+    I tok;              /* Start of the token being scanned */
+    I interactive;      /* Read one line at a time */
+    I mapped;           /* The whole input is in the buffer */
+    char* buf;          /* Last token */
+    char see;           /* Look ahead character */
+    FILE* source;       /* File read instead of standard input, or NULL */
+    jmp_buf* end;       /* Where to jump at the end of `source` */
+    I eof;              /* The end of `source` was reached */
+} Input;
+
+/**
+ * @struct Client
+ * @brief Connection to the server, see serve()
+ * @details Each connection evaluates in its own copy of the interpreter of the
+ * server, made when it's accepted. The characters received are kept until they
+ * form whole expressions, see client_scan().
+ */
+typedef struct {
+    int fd;             /* Socket of the connection */
+    TinyLisp* tl;       /* Interpreter of the connection */
+    char* in;           /* Characters received and not evaluated yet */
+    size_t in_len;      /* Number of characters in `in` */
+    size_t in_size;     /* Number of allocated characters */
+    size_t scanned;     /* Characters of `in` already scanned */
+    size_t complete;    /* Characters of `in` with whole expressions */
+    I depth;            /* Lists still open at `scanned` */
+    I atom;             /* Non-zero if `scanned` is inside of an atom */
+    size_t out_pos;     /* Characters of the output of `tl` already sent */
+    uint32_t events;    /* Events waited for, EPOLLIN or EPOLLOUT */
+    I eof;              /* The client won't send more characters */
+    I closing;          /* Close when the output has been sent */
+} Client;
+
 /*---------------------------------- MACROS ----------------------------------*/
 
 #ifdef VERBOSE_ERRORS
@@ -76,14 +250,338 @@ typedef double L;
 #define HEAP_BOTTOM ((char*)cell)
 
 /**
- * @def N
- * @brief Number of cells for the shared stack and atom heap
- * @todo Allocate in main and overwrite with arguments
+ * @def GLOBAL
+ * @brief Value of the atom `x` in the global environment
+ * @details Each atom name on the heap is preceded by a cell holding its global
+ * value, so global lookups don't need to search a list. See atom().
+ */
+#define GLOBAL(x) unpack(GLOBAL_CELL(x))
+
+/**
+ * @def GLOBAL_CELL
+ * @brief Cell of the global value of the atom `x`, see GLOBAL
+ */
+#define GLOBAL_CELL(x) (((C*)(HEAP_BOTTOM + ord(x)))[-1])
+
+/**
+ * @def ELEM
+ * @brief Element `j` of the NaN-boxed block `x`, see block()
+ */
+#define ELEM(x, j) CELL(ord(x) + 1 + (j))
+
+/**
+ * @def SET_ELEM
+ * @brief Set element `j` of the NaN-boxed block `x` to `y`, without
+ * remembering the block, see put()
+ */
+#define SET_ELEM(x, j, y) SET_CELL(ord(x) + 1 + (j), y)
+
+/**
+ * @def AREF
+ * @brief Number `j` of the NaN-boxed array `x`, see array()
+ * @details Arrays are stored like the other blocks, with the first number bellow
+ * the header, but their numbers are always plain doubles, see elems().
+ */
+#ifdef COMPACT
+#define AREF(x, j) elems(x)[size(x) - 1 - (j)]
+#else
+#define AREF(x, j) cell[N - ord(x) - 1 - (j)]
+#endif
+
+/**
+ * @def ALIGNED
+ * @brief First address of a double at or above the cell address `p`
+ */
+#define ALIGNED(p) \
+    ((L*)(((uintptr_t)(p) + sizeof(L) - 1) & ~(uintptr_t)(sizeof(L) - 1)))
+
+/**
+ * @def ARRAY_CELLS
+ * @brief Number of cells bellow the header of an array of `k` numbers
+ * @details In COMPACT mode, each number takes two cells, and one more is needed
+ * to align them, see elems().
+ */
+#define ARRAY_CELLS(k) \
+    ((k) * (sizeof(L) / sizeof(C)) + (sizeof(L) / sizeof(C) - 1))
+
+/**
+ * @name Block headers
+ * BLOCK_SIZE: mask for the number of elements in the ordinal of a header.
+ *
+ * BLOCK_REMEMBERED: flag in the ordinal of a header, set when the block is in
+ * the remembered set. See remember().
+ */
+#ifdef COMPACT
+#define BLOCK_SIZE       0x01FFFFFFu
+#define BLOCK_REMEMBERED 0x02000000u
+#else
+#define BLOCK_SIZE       0x7FFFFFFFu
+#define BLOCK_REMEMBERED 0x80000000u
+#endif
+
+/**
+ * @name Frame elements
+ * Indexes of the elements of an environment frame, see frame(). The values of
+ * the variables start at FRAME_VARS.
+ */
+#define FRAME_NAMES  0
+#define FRAME_PARENT 1
+#define FRAME_VARS   2
+
+/**
+ * @name Hash table elements
+ * Indexes of the elements of a hash table, see table(). HASH_COUNT is the
+ * number of keys, HASH_MOVABLE the number of keys that are pairs or blocks,
+ * whose bits change when they are moved by the garbage collector, and
+ * HASH_EPOCH the value of epoch when they were hashed. HASH_SLOTS is a vector
+ * of keys and values.
+ */
+#define HASH_COUNT   0
+#define HASH_MOVABLE 1
+#define HASH_EPOCH   2
+#define HASH_SLOTS   3
+
+/**
+ * @name Future elements
+ * Indexes of the elements of a future, see spawn(). FUT_VALUE is the
+ * expression until it's evaluated, and then its value. FUT_STATE is FUT_LAZY,
+ * FUT_QUEUED or FUT_DONE. A queued future stores the address of its Task in
+ * FUT_TASK and FUT_TASK + 1, and the `id` of the interpreter that owns it in
+ * FUT_OWNER.
+ */
+#define FUT_VALUE 0
+#define FUT_ENV   1
+#define FUT_STATE 2
+#define FUT_TASK  3
+#define FUT_OWNER 5
+#define FUT_SIZE  6
+
+#define FUT_LAZY   0
+#define FUT_QUEUED 1
+#define FUT_DONE   2
+
+/**
+ * @name Task states
+ * See Task.
+ */
+#define TASK_QUEUED  0
+#define TASK_RUNNING 1
+#define TASK_DONE    2
+
+/**
+ * @name Memoized closures
+ * A memoized closure, see memoize(), is a CLOS `((c . f))` where `f` is the
+ * original closure, and `c` is a vector of MEMO_WAYS pairs of elements for each
+ * set, an argument list and its value. Empty entries have a HDR box as their
+ * argument list, which can't be a Lisp value. MEMO_ENTRIES is the default
+ * number of entries.
+ */
+#define MEMO_WAYS    2
+#define MEMO_ENTRIES 128
+
+/**
+ * @name Forms
+ * Forms recognized by resolve() in the bodies of the closures, stored in the
+ * GREF box of their function, see gref(). FORM_CALL is a normal call.
+ * FORM_CONST is a call of an arithmetic primitive with constant arguments,
+ * whose value is stored before the arguments. The others are special forms.
+ */
+#define FORM_CALL   0
+#define FORM_CONST  1
+#define FORM_QUOTE  2
+#define FORM_IF     3
+#define FORM_COND   4
+#define FORM_LETA   5
+#define FORM_LAMBDA 6
+
+/**
+ * @def VARIADIC
+ * @brief Number of arguments of the primitive operations that combine any
+ * number of them, left to right, see apply()
+ */
+#define VARIADIC 0
+
+/**
+ * @def NOT_FOUND
+ * @brief Returned by slot() when a variable is not in a list
+ */
+#define NOT_FOUND 0xFFFFFFFFu
+
+/**
+ * @def DEFAULT_CELLS
+ * @brief Default number of cells for the shared stack and atom heap
+ * @details Can be overwritten with the `-n` argument or the `TINYLISP_CELLS`
+ * environment variable. See main().
+ */
+#define DEFAULT_CELLS 1024
+
+/**
+ * @def NURSERY_CELLS
+ * @brief Maximum number of cells in the young generation
+ * @details When this many cells have been allocated since the last collection,
+ * a minor collection is triggered, see minor(). The nursery is never bigger
+ * than a quarter of the cell space.
+ */
+#define NURSERY_CELLS 32768
+
+/**
+ * @def CELL
+ * @brief Access the stack cell with ordinal `i`
+ * @details Ordinals of the stack cells (the ones inside CONS and CLOS boxes) are
+ * measured from the top of the cell[] array, so they stay valid when the cell
+ * space is moved to a bigger region by grow().
+ */
+#define CELL(i) unpack(cell[N - (i)])
+
+/**
+ * @def SET_CELL
+ * @brief Set the stack cell with ordinal `i` to the expression `x`, see CELL
+ */
+#define SET_CELL(i, x) (cell[N - (i)] = pack(x))
+
+/**
+ * @name Compact cells
+ * In COMPACT mode, a cell is one of the following, see pack():
+ * - An integer number between -2^30 and 2^30, shifted left by one bit, with
+ *   the lowest bit set.
+ * - A NaN box whose ordinal fits in CELL_BITS bits, or a box with a zero tag,
+ *   stored as the ordinal shifted left by CELL_SHIFT bits, above a CELL_TAGS
+ *   code of the tag, shifted left by one bit.
+ * - Any other number or NaN box, stored in `wide`, as the index of its element
+ *   above the CELL_WIDE code.
+ *
+ * Otherwise, pack() and unpack() do nothing.
+ */
+#ifdef COMPACT
+#define CELL_SHIFT 6
+#define CELL_BITS  26
+#define CELL_TAGS  16
+#define CELL_WIDE  (CELL_TAGS + 1)
+#else
+#define pack(x)         (x)
+#define unpack(c)       (c)
+#define unpack_in(w, c) (c)
+#endif
+
+/**
+ * @def WIDE_MIN
+ * @brief Number of wide values that can be stored before the first collection
+ * that compacts them, see collect_wide()
+ */
+#define WIDE_MIN 4096
+
+/**
+ * @def WIDE_FULL
+ * @brief Non-zero if the wide values should be collected by the next
+ * allocation, see wide_limit
  */
-#define N 1024
+#ifdef COMPACT
+#define WIDE_FULL (wide_len >= wide_limit)
+#else
+#define WIDE_FULL 0
+#endif
+
+/**
+ * @def MAX_CELLS
+ * @brief Maximum number of cells, so their ordinals fit in a NaN box (or in a
+ * compact cell)
+ */
+#ifdef COMPACT
+#define MAX_CELLS (1u << CELL_BITS)
+#else
+#define MAX_CELLS 0xFFFFFFFFu
+#endif
+
+/**
+ * @def PROTECT
+ * @brief Register the C variable `x` as a garbage collector root
+ * @details The garbage collector moves the cells, so any Lisp expression that
+ * is stored in a C variable and used after a call that might allocate (cons(),
+ * eval(), etc.) needs to be protected, and gc() will update it. Each PROTECT()
+ * must be paired with an UNPROTECT() before the variable goes out of scope.
+ */
+#define PROTECT(x) protect(&(x))
+
+/**
+ * @def UNPROTECT
+ * @brief Remove the last `n` garbage collector roots registered with PROTECT()
+ */
+#define UNPROTECT(n) (rp -= (n))
+
+/**
+ * @def PER_THREAD
+ * @brief Storage class of the globals with the state of the interpreter
+ * @details Each thread has its own copy of them, so the interpreters of
+ * different threads can evaluate at the same time, see TinyLisp.
+ */
+#define PER_THREAD _Thread_local
 
 /*---------------------------------- GLOBALS ---------------------------------*/
 
+/**
+ * @var N
+ * @brief Number of cells for the shared stack and atom heap
+ * @details Set in main(), and increased by grow() if growing is enabled.
+ */
+static PER_THREAD I N = DEFAULT_CELLS;
+
+/**
+ * @var growable
+ * @brief If non-zero, grow the cell space instead of aborting when full
+ * @details Enabled with the `-g` argument or the `TINYLISP_GROW` environment
+ * variable.
+ */
+static PER_THREAD I growable = 0;
+
+/**
+ * @var compiling
+ * @brief If non-zero, the bodies of the closures are compiled to bytecode
+ * @details Enabled with the `-c` argument or the `TINYLISP_COMPILE` environment
+ * variable. See compile().
+ */
+static PER_THREAD I compiling = 0;
+
+/**
+ * @var stats
+ * @brief Allocation and garbage collection counters, see Stats
+ */
+static PER_THREAD Stats stats;
+
+/**
+ * @var threads
+ * @brief Number of threads used by `pmap`, or 0 for one per processor
+ * @details Set with the `-j` argument or the `TINYLISP_THREADS` environment
+ * variable. See pmap().
+ */
+static I threads = 0;
+
+/**
+ * @var profiling
+ * @brief If non-zero, the calls to closures and primitives are profiled
+ * @details Enabled with the `-p` argument or the `TINYLISP_PROFILE` environment
+ * variable. See profile_enter().
+ */
+static PER_THREAD I profiling = 0;
+
+/**
+ * @name Profiler records
+ * profile: counters of each primitive, indexed like prim[], followed by
+ * PROFILE_LAMBDA, PROFILE_TOP and a record for each name closures were defined
+ * under.
+ *
+ * profile_len: number of records in use, profile_size: number of allocated
+ * records.
+ *
+ * profile_current: record of the innermost closure being called, which
+ * allocations are attributed to.
+ *
+ * profiled: hash table with the indexes of the records of each defined closure
+ * and of each name, see profile_define().
+ */
+static PER_THREAD Profile* profile = NULL;
+static PER_THREAD I profile_len = 0, profile_size = 0, profile_current = 0;
+static PER_THREAD L profiled;
+
 /**
  * @name Heap and stack pointer
  * hp: heap pointer. Will be used as an offset in the cell[] array, by adding it
@@ -92,31 +590,207 @@ typedef double L;
  * sp: stack pointer. Stack starts at the top of the cell[] array, and its
  * initial value is N, the size of the array: cell[N]
  */
-static I hp = 0, sp = N;
+static PER_THREAD I hp = 0, sp = DEFAULT_CELLS;
+
+/**
+ * @var epoch
+ * @brief Number of garbage collections so far
+ * @details Hash tables with keys that can be moved are hashed again when this
+ * changes, see refresh().
+ */
+static PER_THREAD I epoch = 0;
+
+/**
+ * @name Generations
+ * old_sp: the cells in [old_sp, N) survived a garbage collection, and the ones
+ * in [sp, old_sp) are young. Only the young ones are collected by minor().
+ *
+ * nursery: maximum number of young cells, see NURSERY_CELLS.
+ */
+static PER_THREAD I old_sp = DEFAULT_CELLS, nursery = NURSERY_CELLS;
+
+/**
+ * @name Symbol table
+ * symtab: open addressing hash table used by atom() to find atom names. Each
+ * slot contains the heap offset of an atom plus one, or zero if the slot is
+ * empty.
+ *
+ * symtab_size: number of slots, always a power of two.
+ *
+ * symtab_used: number of non-empty slots.
+ */
+static PER_THREAD I* symtab = NULL;
+static PER_THREAD I symtab_size = 0, symtab_used = 0;
 
 /**
  * @name Tags for NaN boxing
- * Atom, primitive, cons, closure and nil
+ * Atom, primitive, cons, closure, nil, vector, array of numbers, hash table
+ * and future. Futures share their tag with the negative NaN numbers, which have
+ * a zero ordinal, see is_future(). Environment frames are created by closures
+ * and `let*`, see frame(), references to local and global variables by
+ * address(), and bytecode by the compiler, see compile(). The forwarding and
+ * block header tags (HDR for blocks of expressions, RAW for arrays) are only
+ * used internally by the garbage collector, see move(), block() and array().
  */
 static I ATOM = 0x7ff8, PRIM = 0x7ff9, CONS = 0x7ffa, CLOS = 0x7ffb,
-         NIL = 0x7ffc;
+         NIL = 0x7ffc, FWD = 0x7ffd, VEC = 0x7ffe, ARR = 0x7fff,
+         FRAME = 0xfff9, LREF = 0xfffa, HDR = 0xfffb, CODE = 0xfffc,
+         RAW = 0xfffd, HASH = 0xfffe, GREF = 0xffff, FUT = 0xfff8;
 
 /**
  * @var cell
  * @brief Array of Lisp expressions, shared by the stack and atom heap
- * @details Array of N (1024 by default) tagged floats
+ * @details Array of N (1024 by default) tagged floats, allocated in main()
  */
-static L cell[N];
+static PER_THREAD C* cell;
+
+/**
+ * @var spare
+ * @brief Second cell space, used by the garbage collector to copy the live
+ * cells into
+ * @details Same size as cell[]. Allocated by the first gc().
+ */
+static PER_THREAD C* spare = NULL;
+
+/**
+ * @name Wide values
+ * wide: numbers and NaN boxes that don't fit in a compact cell, referenced by
+ * their index from the cells, see pack(). Only used in COMPACT mode.
+ *
+ * wide_len: number of elements in use, wide_size: number of allocated elements.
+ *
+ * wide_limit: when wide_len reaches it, the next allocation collects both
+ * generations, which removes the values that are not referenced anymore, see
+ * collect_wide().
+ */
+static PER_THREAD L* wide = NULL;
+static PER_THREAD I wide_len = 0, wide_size = 0, wide_limit = WIDE_MIN;
+
+/**
+ * @name Garbage collector roots
+ * roots: addresses of the C variables holding Lisp expressions that must
+ * survive a garbage collection, see PROTECT().
+ *
+ * rp: number of roots in use.
+ *
+ * roots_size: number of allocated roots.
+ */
+static PER_THREAD L** roots = NULL;
+static PER_THREAD I rp = 0, roots_size = 0;
+
+/**
+ * @name Remembered set
+ * dirty: atoms whose global value, and old pairs or blocks whose elements, were
+ * set to young cells since the last collection. Since they are not scanned by
+ * minor(), it needs them as additional roots. See remember().
+ *
+ * dirty_len: number of elements in dirty[].
+ *
+ * dirty_size: number of allocated elements.
+ */
+static PER_THREAD L* dirty = NULL;
+static PER_THREAD I dirty_len = 0, dirty_size = 0;
+
+/**
+ * @name Bytecode buffers
+ * ops: instructions emitted by compile(), before they are copied to a CODE
+ * block.
+ *
+ * vm: stack of the virtual machine, with the intermediate values and the return
+ * addresses of exec().
+ *
+ * Both are garbage collector roots. ops_len and vp are the number of elements in
+ * use, and ops_size and vm_size the number of allocated elements.
+ */
+static PER_THREAD L* ops = NULL;
+static PER_THREAD I ops_len = 0, ops_size = 0;
+static PER_THREAD L* vm = NULL;
+static PER_THREAD I vp = 0, vm_size = 0;
 
 /**
  * @name Lisp constant expressions
  * List:
- * - `nil` (empty list)
+ * - `nil` (empty list, also the empty local environment)
  * - `t` (explicit truth)
  * - `err` (returned to indicate errors)
- * - `env` (global enviroment)
  */
-static L nil, tru, err, env;
+static PER_THREAD L nil, tru, err;
+
+/**
+ * @name Thread pool
+ * pool_lock: protects the other variables of the pool, and the `pending`
+ * counters of the chunks.
+ *
+ * pool_work: signaled when chunks are added to pool_queue.
+ *
+ * pool_done: broadcast when a worker finishes a chunk.
+ *
+ * pool_queue: chunks waiting for a worker, see Chunk.
+ *
+ * pool_size: number of worker threads started so far.
+ *
+ * pool_idle: number of workers waiting for chunks or tasks.
+ *
+ * pool_queued: number of tasks in the deques.
+ *
+ * deques: list of the deques of all the threads, see Deque.
+ *
+ * contexts: number of interpreters created so far, used for their `id`.
+ */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done  = PTHREAD_COND_INITIALIZER;
+static Chunk* pool_queue         = NULL;
+static I pool_size               = 0;
+static I pool_idle               = 0;
+static I pool_queued             = 0;
+static Deque* deques             = NULL;
+static I contexts                = 0;
+
+/**
+ * @var worker
+ * @brief Non-zero in the worker threads of the pool
+ * @details A `pmap` inside of a worker is evaluated sequentially, since it
+ * would wait for the workers that are evaluating it.
+ */
+static PER_THREAD I worker = 0;
+
+/**
+ * @name Futures
+ * deque: tasks queued by this thread.
+ *
+ * id: identifier of the interpreter of this thread, unique in the process, so
+ * futures copied from other interpreters can be told apart, see touch().
+ *
+ * tasks: list of the tasks of this interpreter that were not touched yet.
+ */
+static PER_THREAD Deque* deque = NULL;
+static PER_THREAD I id         = 0;
+static PER_THREAD Task* tasks  = NULL;
+
+/**
+ * @name Library state
+ * context: interpreter being evaluated by eval_source() in this thread, or
+ * NULL in the REPL. The output is appended to its buffer, see flush().
+ *
+ * finish: where stop() and out_of_memory() return to in eval_source(), or
+ * NULL in the REPL, which exits or aborts instead. The workers of the pool
+ * return to evaluate() and run(), which stop the chunk or the task.
+ */
+static PER_THREAD TinyLisp* context = NULL;
+static PER_THREAD jmp_buf* finish = NULL;
+
+/**
+ * @name Results of eval_source()
+ * EVAL_END: the whole source was evaluated.
+ *
+ * EVAL_QUIT: the evaluation was stopped by `(quit)`.
+ *
+ * EVAL_MEMORY: the cell space ran out of memory, see out_of_memory().
+ */
+#define EVAL_END    0
+#define EVAL_QUIT   1
+#define EVAL_MEMORY 2
 
 /*--------------------------------- FUNCTIONS --------------------------------*/
 
@@ -129,20 +803,97 @@ static L box(I t, I i);
 static I ord(L x);
 static L num(L n);
 static I equ(L x, L y);
+#ifdef COMPACT
+static C pack(L x);
+static L unpack_in(const L* w, C c);
+static L unpack(C c);
+#endif
+static void protect(L* x);
+static I is_pair(L x);
+static I is_block(L x);
+static I is_future(L x);
+static I young(L x);
+static L move(L x);
+static C move_cell(C c);
+static void remember(L x);
+static void collect(void);
+static void alloc_spare(void);
+static void minor(void);
+static void gc(void);
+static void collect_wide(void);
+static void collected(uint64_t ns);
+static _Noreturn void out_of_memory(const char* msg);
+static void grow(void);
+static void reserve(uint64_t bytes);
+static I fits(uint64_t k);
+static I strhash(const char* s);
+static void rehash(I size);
 static L atom(const char* s);
+static void define(L v, L x);
 static L cons(L x, L y);
 static L car(L p);
 static L cdr(L p);
+static void setcdr(L p, L x);
 static L pair(L v, L x, L e);
 static L closure(L v, L x, L e);
+static L block(I t, I k, L x);
+static L array(I k, L n);
+static I size(L b);
+static L* elems(L b);
+static void put(L b, I j, L x);
+static I keyhash(L x);
+static L table(void);
+static I lookup(L h, L x);
+static void resize(L h, I cap);
+static void refresh(L h);
+static L hash_get(L h, L x, L d);
+static void hash_put(L h, L x, L y);
+static I hash_remove(L h, L x);
+static I slots(L v);
+static I slot(L x, L v);
+static L frame(L v, L e);
+static L global(L v);
 static L assoc(L v, L e);
+static L local(L x, L e);
 static I not(L x);
 static I let(L x);
 static L evlis(L t, L e);
 static L bind(L v, L t, L e);
 static L reduce(L f, L t, L e);
-static L apply(L f, L t, L e);
+static L lref(I depth, I i, L v);
+static L gref(L v, I form, L p);
+static I gref_form(L x);
+static I foldable(L p, L t);
+static L address(L v, L s, L e);
+static L resolve_list(L t, L s, L e);
+static L resolve_let(L t, L s, L e);
+static L resolve_cond(L t, L s, L e);
+static L resolve(L x, L s, L e);
+static L apply(L (*op)(L, L), I n, L t, L e);
+static I memoized(L f);
+static L memoize(L f, I n);
+static I memo_hash(L t);
+static I memo_equ(L t, L u);
+static L memo_apply(L f, L t);
+static L combine(L f, const L* a, I k);
 static L eval(L x, L e);
+static I emit(L x);
+static I emit_raw(I op);
+static void patch(I at);
+static I length(L t);
+static I bound(L v, L s, L e);
+static void compile_cond(L t, L s, L e, I tail);
+static void compile_logic(L t, L s, L e, I op);
+static void compile_call(L x, L s, L e, I tail);
+static I compile_form(L x, L p, L s, L e, I tail);
+static void compile_expr(L x, L s, L e, I tail);
+static L compile(L v, L x, L s, L e);
+static inline void vm_push(L x);
+static L quoted(I n);
+static L exec(L code, L* env, I* more);
+static _Noreturn void stop(void);
+static void fill(void);
+static I map_input(const char* path);
 static void look();
 static inline I seeing(char c);
 static char get();
@@ -152,9 +903,72 @@ static L list();
 static L quote();
 static L atomic();
 static L parse();
+static I next_form(L* x);
+static void forms_end(const Input* saved, FILE* fp);
+static L forms(L f, L x, L path, I fold);
+static L call2(L f, L x, L y);
+static void flush(void);
+static void out_mem(const char* s, I n);
+static void out_str(const char* s);
+static void out_fmt(FILE* fp, const char* fmt, ...);
+static void out_char(char c);
+static void out_num(L n);
+static void push_pending(L t);
+static void printatom(L x);
 static void print(L x);
-static void printlist(L t);
-static void gc();
-int main();
+static I prims(void);
+static uint64_t now(void);
+static I profile_add(const char* label, L name);
+static void profile_init(void);
+static void profile_define(L v, L x);
+static I profile_closure(L f);
+static void profile_enter(I r);
+static void profile_leave(I r);
+static int profile_cmp(const void* a, const void* b);
+static void profile_report(FILE* fp);
+static void profile_exit(void);
+static void print_stats(FILE* fp);
+static void stats_exit(void);
+static void append(L** a, I* len, I* size, L x);
+static void shared(const TinyLisp* w, I limit, L x, L** found, I* len,
+                   I* size);
+static L import_cell(const TinyLisp* w, I base, L x, L memo, L* todo);
+static L import(const TinyLisp* w, I base, L x, L memo);
+static L import_all(I n, const TinyLisp** ws, const L* xs, I base, I limit);
+static void clone(TinyLisp* tl, const TinyLisp* from);
+static void release(TinyLisp* tl);
+static I fresh_id(void);
+static L call(L f, L x);
+static void unwind(void);
+static void evaluate(Chunk* c);
+static void run(Task* t);
+static void push(Task* t);
+static Task* steal(void);
+static void unqueue(Task* t);
+static void abandon(Task* t);
+static void* work(void* arg);
+static void pool_start(I n);
+static void pmap_end(I n, Chunk* cs, const TinyLisp** ws, L* xs);
+static L pmap(L f, L t);
+static L spawn(L x, L e);
+static L touch(L f);
+static void make_lazy(L f);
+static void lazy_futures(void);
+static void dump_image(void);
+static I load_image(const char* path);
+static I init(const char* load);
+static void context_load(const TinyLisp* tl);
+static void context_save(TinyLisp* tl);
+static I eval_source(TinyLisp* tl, const char* src, size_t k);
+static void context_free(TinyLisp* tl);
+static void client_scan(Client* c);
+static void client_wait(int ep, Client* c, uint32_t events);
+static void client_close(Client* c);
+static void client_write(int ep, Client* c);
+static void client_eval(int ep, Client* c);
+static void client_read(int ep, Client* c);
+static void client_accept(int ep, int fd, const TinyLisp* warm);
+static int serve(const char* addr, I prelude);
+int main(int argc, char** argv);
 
 #endif    // TINYLISP_H_